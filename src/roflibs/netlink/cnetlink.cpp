@@ -4,11 +4,13 @@
 #include <fstream>
 
 #include "cnetlink.hpp"
+#include "roflibs/netlink/tap_manager.hpp"
 
 namespace rofcore {
 
 cnetlink::cnetlink(switch_interface *swi)
-    : swi(swi), thread(this), bridge(nullptr), running(false) {
+    : swi(swi), tap_man(nullptr), thread(this), bridge(nullptr),
+      running(false), links_replayed(false), congested(false) {
 
   sock = nl_socket_alloc();
   if (NULL == sock) {
@@ -94,15 +96,21 @@ void cnetlink::init_caches() {
     LOG(FATAL) << "cnetlink::init_caches() add route/neigh to cache mngr";
   }
 
-  struct nl_object *obj = nl_cache_get_first(caches[NL_LINK_CACHE]);
-  while (0 != obj) {
-    VLOG(1) << "cnetlink::" << __FUNCTION__ << "(): adding "
-            << rtnl_link_get_name((struct rtnl_link *)obj) << " to rtlinks";
-    rtlinks.add_link(crtlink((struct rtnl_link *)obj));
-    obj = nl_cache_get_next(obj);
+  // rtlinks keeps one family of a link, the bridge one if there is one.
+  // Others like AF_INET6 are in the cache as well.
+  for (int family : {AF_UNSPEC, AF_BRIDGE}) {
+    struct nl_object *obj = nl_cache_get_first(caches[NL_LINK_CACHE]);
+    for (; 0 != obj; obj = nl_cache_get_next(obj)) {
+      if (family != rtnl_link_get_family((struct rtnl_link *)obj)) {
+        continue;
+      }
+      VLOG(1) << "cnetlink::" << __FUNCTION__ << "(): adding "
+              << rtnl_link_get_name((struct rtnl_link *)obj) << " to rtlinks";
+      rtlinks.add_link(crtlink((struct rtnl_link *)obj));
+    }
   }
 
-  obj = nl_cache_get_first(caches[NL_NEIGH_CACHE]);
+  struct nl_object *obj = nl_cache_get_first(caches[NL_NEIGH_CACHE]);
   while (0 != obj) {
     unsigned int ifindex = rtnl_neigh_get_ifindex((struct rtnl_neigh *)obj);
     switch (rtnl_neigh_get_family((struct rtnl_neigh *)obj)) {
@@ -132,13 +140,61 @@ cnetlink &cnetlink::get_instance() {
   return instance;
 }
 
-void cnetlink::register_link(int id, std::string port_name) {
-  registered_ports.insert(std::make_pair(port_name, id));
+void cnetlink::register_links(
+    const std::deque<std::pair<int, std::string>> &links) {
+  for (auto &l : links) {
+    registered_ports.insert(std::make_pair(l.second, l.first));
+  }
+}
+
+void cnetlink::start() {
+  // on the netlink thread, before the queued events
+  thread.add_timer(NL_TIMER_START, rofl::ctimespec().expire_in(0));
+}
+
+void cnetlink::replay_registered_links() {
+  std::set<int> replayed;
+
+  // like the dump, the bridge family of a link is applied last
+  for (int family : {AF_UNSPEC, AF_BRIDGE}) {
+    struct nl_object *obj = nl_cache_get_first(caches[NL_LINK_CACHE]);
+    for (; 0 != obj; obj = nl_cache_get_next(obj)) {
+      struct rtnl_link *link = (struct rtnl_link *)obj;
+      int ifindex = rtnl_link_get_ifindex(link);
+      const char *name = rtnl_link_get_name(link);
+
+      // links created since the dump are announced by their own events
+      if (family != rtnl_link_get_family(link) || nullptr == name ||
+          not rtlinks.has_link(ifindex) ||
+          0 == registered_ports.count(std::string(name))) {
+        continue;
+      }
+      VLOG(1) << __FUNCTION__ << ": " << name << " family " << family;
+      route_link_apply(NL_ACT_NEW, nl_obj(obj));
+      replayed.insert(ifindex);
+    }
+  }
+
+  struct nl_object *obj = nl_cache_get_first(caches[NL_NEIGH_CACHE]);
+  for (; 0 != obj; obj = nl_cache_get_next(obj)) {
+    struct rtnl_neigh *neigh = (struct rtnl_neigh *)obj;
+    unsigned int ifindex = rtnl_neigh_get_ifindex(neigh);
+    if (AF_BRIDGE != rtnl_neigh_get_family(neigh) ||
+        0 == replayed.count(ifindex)) {
+      continue;
+    }
+    crtneigh n(neigh);
+    neighs_ll[ifindex].add_neigh(n);
+    neigh_ll_created(ifindex, n);
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": " << replayed.size()
+            << " registered links existed before the start";
 }
 
 void cnetlink::handle_wakeup(rofl::cthread &thread) {
-  // loop through nl_objs
-  for (int cnt = 0; cnt < 10 && nl_objs.size() && running;
+  // loop through nl_objs, unless the switch cannot take more updates
+  for (int cnt = 0; cnt < 10 && nl_objs.size() && running && !congested;
        cnt++) { // TODO cnt_max as member
     auto obj = nl_objs.front();
 
@@ -153,10 +209,10 @@ void cnetlink::handle_wakeup(rofl::cthread &thread) {
     default:
       break;
     }
-    nl_objs.pop_front();
+    dequeue_nl_obj();
   }
 
-  if (nl_objs.size()) {
+  if (nl_objs.size() && !congested) {
     this->thread.wakeup();
   }
 }
@@ -230,6 +286,14 @@ void cnetlink::handle_timeout(rofl::cthread &thread, uint32_t timer_id,
     // was stopped before
     start();
     break;
+  case NL_TIMER_START:
+    if (not links_replayed) {
+      replay_registered_links();
+      links_replayed = true;
+    }
+    running = true;
+    this->thread.wakeup();
+    break;
   default:
     break;
   }
@@ -240,9 +304,84 @@ void cnetlink::nl_cb(struct nl_cache *cache, struct nl_object *obj, int action,
                      void *data) {
   assert(obj);
 
-  nl_obj lobj(obj);
-  cnetlink::get_instance().nl_objs.push_back(
-      std::make_pair(action, std::move(lobj)));
+  cnetlink::get_instance().enqueue_nl_obj(action, obj);
+}
+
+bool cnetlink::get_neigh_key(const struct nl_object *obj, neigh_key *key) {
+  int msgtype = nl_object_get_msgtype(obj);
+  struct rtnl_neigh *neigh = (struct rtnl_neigh *)obj;
+
+  if ((RTM_NEWNEIGH != msgtype && RTM_DELNEIGH != msgtype) ||
+      AF_BRIDGE != rtnl_neigh_get_family(neigh)) {
+    return false;
+  }
+
+  key->ifindex = rtnl_neigh_get_ifindex(neigh);
+  key->vlan = rtnl_neigh_get_vlan(neigh);
+  key->lladdr = 0;
+
+  struct nl_addr *lladdr = rtnl_neigh_get_lladdr(neigh);
+  if (lladdr) {
+    const uint8_t *a = (const uint8_t *)nl_addr_get_binary_addr(lladdr);
+    for (unsigned i = 0; i < nl_addr_get_len(lladdr) && i < 8; i++) {
+      key->lladdr = (key->lladdr << 8) | a[i];
+    }
+  }
+  return true;
+}
+
+void cnetlink::enqueue_nl_obj(int action, struct nl_object *obj) {
+  neigh_key key;
+
+  // only bridge fdb entries are coalesced, these come in storms. links are
+  // always applied in order.
+  if (get_neigh_key(obj, &key)) {
+    auto it = pending_neighs.find(key);
+    if (it != pending_neighs.end()) {
+      int pending = it->second->first;
+
+      if (NL_ACT_CHANGE == action &&
+          (NL_ACT_NEW == pending || NL_ACT_CHANGE == pending)) {
+        // keep the pending action, but apply the latest state
+        it->second->second = nl_obj(obj);
+        stats.coalesced++;
+        return;
+      }
+
+      if (NL_ACT_DEL == action && NL_ACT_NEW == pending) {
+        // entry came and went while pending, nothing to apply
+        nl_objs.erase(it->second);
+        pending_neighs.erase(it);
+        stats.queue_depth--;
+        stats.coalesced += 2;
+        return;
+      }
+    }
+
+    nl_objs.push_back(std::make_pair(action, nl_obj(obj)));
+    pending_neighs[key] = std::prev(nl_objs.end());
+  } else {
+    nl_objs.push_back(std::make_pair(action, nl_obj(obj)));
+  }
+
+  if (++stats.queue_depth > stats.queue_depth_max) {
+    stats.queue_depth_max = stats.queue_depth.load();
+  }
+}
+
+void cnetlink::dequeue_nl_obj() {
+  neigh_key key;
+  auto front = nl_objs.begin();
+
+  if (get_neigh_key(front->second.get_obj(), &key)) {
+    auto it = pending_neighs.find(key);
+    if (it != pending_neighs.end() && it->second == front) {
+      pending_neighs.erase(it);
+    }
+  }
+
+  nl_objs.pop_front();
+  stats.queue_depth--;
 }
 
 void cnetlink::route_link_apply(int action, const nl_obj &obj) {
@@ -269,6 +408,11 @@ void cnetlink::route_link_apply(int action, const nl_obj &obj) {
 
   crtlink rtlink((struct rtnl_link *)obj.get_obj());
 
+  // frames of the tap device must fit its mtu
+  if (NL_ACT_DEL != action && nullptr != tap_man) {
+    tap_man->set_mtu(s1->second, rtlink.get_mtu());
+  }
+
   try {
     switch (action) {
     case NL_ACT_NEW: {
@@ -563,8 +707,12 @@ void cnetlink::neigh_ll_created(unsigned int ifindex,
           VLOG(1) << __FUNCTION__ << ": parent=" << rtl.get_hwaddr();
         }
 
+        // static entries are configured, everything else was learned
+        bool learned = not(rtn.get_state() & (NUD_PERMANENT | NUD_NOARP));
+
         auto port = ifindex_to_registered_port.at(rtl.get_ifindex());
-        bridge->add_mac_to_fdb(port, rtn.get_vlan(), rtn.get_lladdr());
+        bridge->add_mac_to_fdb(port, rtn.get_vlan(), rtn.get_lladdr(),
+                               learned);
       } catch (std::out_of_range &e) {
         LOG(ERROR) << __FUNCTION__ << ": port " << rtl
                    << " not in ifindex_to_registered_port: " << e.what();
@@ -619,6 +767,34 @@ void cnetlink::resend_state() noexcept {
   thread.add_timer(NL_TIMER_RESEND_STATE, rofl::ctimespec().expire_in(0));
 }
 
+void cnetlink::congestion_occured() noexcept {
+  if (congested.exchange(true)) {
+    return;
+  }
+
+  pause_start = std::chrono::steady_clock::now();
+  stats.pauses++;
+  LOG(WARNING) << __FUNCTION__ << ": pausing switch updates, queue depth "
+               << stats.queue_depth;
+}
+
+void cnetlink::congestion_solved() noexcept {
+  if (not congested.exchange(false)) {
+    return;
+  }
+
+  uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - pause_start)
+                    .count();
+  stats.last_pause_ms = ms;
+  stats.paused_ms += ms;
+  LOG(INFO) << __FUNCTION__ << ": resuming switch updates after " << ms
+            << "ms, queue depth " << stats.queue_depth << " (coalesced "
+            << stats.coalesced << ")";
+
+  thread.wakeup();
+}
+
 void cnetlink::register_switch(switch_interface *swi) noexcept {
   assert(swi);
   this->swi = swi;
@@ -5,8 +5,12 @@
 #ifndef CNETLINK_H_
 #define CNETLINK_H_ 1
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <exception>
+#include <list>
+#include <set>
 
 #include <glog/logging.h>
 #include <netlink/cache.h>
@@ -40,6 +44,8 @@ public:
   eNetLinkFailed(const std::string &__arg) : eNetLinkBase(__arg){};
 };
 
+class tap_manager;
+
 class cnetlink : public rofl::cthread_env, public rofcore::nbi {
   enum nl_cache_t {
     NL_LINK_CACHE,
@@ -49,9 +55,11 @@ class cnetlink : public rofl::cthread_env, public rofcore::nbi {
   enum timer {
     NL_TIMER_RESEND_STATE,
     NL_TIMER_RESYNC,
+    NL_TIMER_START,
   };
 
   switch_interface *swi;
+  tap_manager *tap_man;
 
   rofl::cthread thread;
   struct nl_sock *sock;
@@ -63,7 +71,40 @@ class cnetlink : public rofl::cthread_env, public rofcore::nbi {
   ofdpa_bridge *bridge;
 
   bool running;
-  std::deque<std::pair<int, nl_obj>> nl_objs;
+  bool links_replayed;
+  std::atomic<bool> congested;
+  std::list<std::pair<int, nl_obj>> nl_objs;
+
+  // pending neighbor events by (ifindex, vlan, lladdr), used for coalescing
+  struct neigh_key {
+    int ifindex;
+    int vlan;
+    uint64_t lladdr;
+
+    bool operator<(const neigh_key &other) const {
+      if (ifindex != other.ifindex)
+        return ifindex < other.ifindex;
+      if (vlan != other.vlan)
+        return vlan < other.vlan;
+      return lladdr < other.lladdr;
+    }
+  };
+  std::map<neigh_key, std::list<std::pair<int, nl_obj>>::iterator>
+      pending_neighs;
+
+  struct nl_stats {
+    nl_stats()
+        : queue_depth(0), queue_depth_max(0), coalesced(0), pauses(0),
+          paused_ms(0), last_pause_ms(0) {}
+
+    std::atomic<uint64_t> queue_depth;
+    std::atomic<uint64_t> queue_depth_max;
+    std::atomic<uint64_t> coalesced;
+    std::atomic<uint64_t> pauses;
+    std::atomic<uint64_t> paused_ms;
+    std::atomic<uint64_t> last_pause_ms;
+  } stats;
+  std::chrono::steady_clock::time_point pause_start;
 
   crtlinks
       rtlinks; // all links in system => key:ifindex, value:crtlink instance
@@ -71,9 +112,20 @@ class cnetlink : public rofl::cthread_env, public rofcore::nbi {
 
   std::set<int> missing_links;
 
+  static bool get_neigh_key(const struct nl_object *obj, neigh_key *key);
+  void enqueue_nl_obj(int action, struct nl_object *obj);
+  void dequeue_nl_obj();
+
   void route_link_apply(int action, const nl_obj &obj);
   void route_neigh_apply(int action, const nl_obj &obj);
 
+  /**
+   * apply the cached links of the registered ports and their bridge
+   * neighbours, which existed before the start. Persisted tap devices
+   * are not announced again when they are opened.
+   */
+  void replay_registered_links();
+
   enum cnetlink_event_t {
     EVENT_NONE,
     EVENT_UPDATE_LINKS,
@@ -112,12 +164,28 @@ class cnetlink : public rofl::cthread_env, public rofcore::nbi {
 public:
   friend std::ostream &operator<<(std::ostream &os, const cnetlink &netlink) {
     os << "<cnetlink>" << std::endl;
+    os << "<queue depth: " << netlink.get_queue_depth()
+       << " max: " << netlink.stats.queue_depth_max
+       << " coalesced: " << netlink.stats.coalesced << " >" << std::endl;
+    os << "<congested: " << netlink.congested
+       << " pauses: " << netlink.stats.pauses
+       << " paused (ms): " << netlink.stats.paused_ms
+       << " last pause (ms): " << netlink.stats.last_pause_ms << " >"
+       << std::endl;
     os << netlink.rtlinks;
     return os;
   }
 
   void resend_state() noexcept override;
 
+  void congestion_occured() noexcept override;
+
+  void congestion_solved() noexcept override;
+
+  size_t get_queue_depth() const { return stats.queue_depth; }
+
+  bool is_congested() const { return congested; }
+
   void register_switch(switch_interface *) noexcept override;
 
   static void nl_cb(struct nl_cache *cache, struct nl_object *obj, int action,
@@ -129,12 +197,20 @@ public:
 
   crtlinks &set_links() { return rtlinks; };
 
-  void register_link(int, std::string);
+  /**
+   * register the links of a set of tap devices, before they are opened
+   */
+  void register_links(const std::deque<std::pair<int, std::string>> &links);
 
-  void start() {
-    running = true;
-    thread.wakeup();
-  }
+  /**
+   * the tap devices of the registered links, informed about mtu changes
+   */
+  void set_tap_manager(tap_manager *tap_man) { this->tap_man = tap_man; }
+
+  /**
+   * apply the registered links found at startup, then the queued events
+   */
+  void start();
 
   void stop() { running = false; }
 
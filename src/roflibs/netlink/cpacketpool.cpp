@@ -2,53 +2,249 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <algorithm>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
 #include "cpacketpool.hpp"
 
+DEFINE_int32(packet_pool_max, 4096,
+             "Maximum number of packet buffers of the default size class");
+DEFINE_int32(packet_pool_jumbo_max, 256,
+             "Maximum number of packet buffers of the jumbo size class");
+DEFINE_bool(packet_pool_slab, false,
+            "Carve packet buffers from one hugepage backed region per size "
+            "class");
+
 using namespace rofcore;
 
-cpacketpool::cpacketpool(unsigned int n_pkts, unsigned int pkt_size) {
-  for (unsigned int i = 0; i < n_pkts; ++i) {
-    rofl::cpacket *pkt = new rofl::cpacket(pkt_size);
-    pktpool.push_back(pkt);
-    idlepool.push_back(pkt);
+static size_t roundup_pow2(size_t n) {
+  size_t r = 1;
+  while (r < n) {
+    r <<= 1;
+  }
+  return r;
+}
+
+packet_depot::packet_depot(size_t capacity)
+    : cells(nullptr), mask(0), head(0), tail(0) {
+  capacity = roundup_pow2(std::max(capacity, (size_t)2));
+  cells = new cell[capacity];
+  mask = capacity - 1;
+  for (size_t i = 0; i < capacity; i++) {
+    cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+packet_depot::~packet_depot() { delete[] cells; }
+
+bool packet_depot::push(packet *pkt) {
+  size_t pos = tail.load(std::memory_order_relaxed);
+  for (;;) {
+    cell &c = cells[pos & mask];
+    size_t seq = c.seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (tail.compare_exchange_weak(pos, pos + 1,
+                                     std::memory_order_relaxed)) {
+        c.pkt = pkt;
+        c.seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      if (pos - head.load(std::memory_order_acquire) > mask) {
+        return false; // full
+      }
+      // a concurrent pop has not yet released the cell
+      std::this_thread::yield();
+      pos = tail.load(std::memory_order_relaxed);
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool packet_depot::pop(packet *&pkt) {
+  size_t pos = head.load(std::memory_order_relaxed);
+  for (;;) {
+    cell &c = cells[pos & mask];
+    size_t seq = c.seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (head.compare_exchange_weak(pos, pos + 1,
+                                     std::memory_order_relaxed)) {
+        pkt = c.pkt;
+        c.seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      if (tail.load(std::memory_order_acquire) == pos) {
+        return false; // empty
+      }
+      // a concurrent push has not yet filled the cell
+      std::this_thread::yield();
+      pos = head.load(std::memory_order_relaxed);
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
   }
+}
 
-  pktpool.shrink_to_fit();
-  idlepool.shrink_to_fit();
+const unsigned cpacketpool::MAGAZINE_SIZE;
+const unsigned cpacketpool::MAGAZINE_SHARE;
+
+thread_local cpacketpool::thread_cache cpacketpool::cache;
+
+cpacketpool::thread_cache::~thread_cache() {
+  // hand the idle packets of an exiting thread back to the depot
+  for (unsigned c = 0; c < SIZE_CLASS_MAX; c++) {
+    if (mags[c].n) {
+      cpacketpool::get_instance().flush((enum size_class)c, mags[c],
+                                        mags[c].n);
+    }
+  }
+}
+
+cpacketpool::cpacketpool(unsigned int n_pkts, unsigned int n_jumbo_pkts) {
+  pools[SIZE_CLASS_DEFAULT] =
+      new pool(std::max(FLAGS_packet_pool_max, (int)n_pkts));
+  pools[SIZE_CLASS_JUMBO] =
+      new pool(std::max(FLAGS_packet_pool_jumbo_max, (int)n_jumbo_pkts));
+
+  // the rest is allocated on demand
+  unsigned int initial[SIZE_CLASS_MAX] = {n_pkts, n_jumbo_pkts};
+  for (unsigned c = 0; c < SIZE_CLASS_MAX; c++) {
+    packet *pkts[MAGAZINE_SIZE];
+    unsigned n;
+    while (initial[c] &&
+           (n = grow((enum size_class)c, pkts,
+                     std::min(initial[c], MAGAZINE_SIZE))) > 0) {
+      for (unsigned i = 0; i < n; i++) {
+        pools[c]->depot.push(pkts[i]);
+      }
+      initial[c] -= n;
+    }
+  }
 }
 
 cpacketpool::cpacketpool(cpacketpool const &packetpool) {}
 
 cpacketpool::~cpacketpool() {
-  for (std::vector<rofl::cpacket *>::iterator it = pktpool.begin();
-       it != pktpool.end(); ++it) {
-    delete (*it);
+  for (auto p : pools) {
+    for (std::vector<packet *>::iterator it = p->pktpool.begin();
+         it != p->pktpool.end(); ++it) {
+      delete (*it);
+    }
+    p->pktpool.clear();
+    delete p->slab;
+    delete p;
   }
-  pktpool.clear();
 }
 
 cpacketpool &cpacketpool::get_instance(unsigned int n_pkts,
-                                       unsigned int pkt_size) {
-  static cpacketpool instance(n_pkts, pkt_size);
+                                       unsigned int n_jumbo_pkts) {
+  static cpacketpool instance(n_pkts, n_jumbo_pkts);
   return instance;
 }
 
-rofl::cpacket *cpacketpool::acquire_pkt() {
-  rofl::AcquireReadWriteLock rwlock(pool_rwlock);
-  if (idlepool.empty()) {
-    throw ePacketPoolExhausted(
-        "cpacketpool::acquire_pkt() packetpool exhausted");
+size_t cpacketpool::get_class_size(enum size_class c) {
+  switch (c) {
+  case SIZE_CLASS_DEFAULT:
+    return 2048 - packet::HEADROOM;
+  case SIZE_CLASS_JUMBO:
+    return 10240 - packet::HEADROOM;
+  default:
+    return 0;
+  }
+}
+
+unsigned cpacketpool::grow(enum size_class c, packet **pkts, unsigned n) {
+  pool &p = *pools[c];
+
+  // reserve the packets against the maximum
+  size_t allocated = p.allocated.load();
+  do {
+    if (allocated >= p.max_pkts) {
+      return 0;
+    }
+    n = std::min((size_t)n, p.max_pkts - allocated);
+  } while (not p.allocated.compare_exchange_weak(allocated, allocated + n));
+
+  rofl::AcquireReadWriteLock rwlock(grow_rwlock);
+  size_t buf_size = get_class_size(c) + packet::HEADROOM;
+  if (FLAGS_packet_pool_slab && p.slab == nullptr && not p.slab_failed) {
+    try {
+      // the whole class, hugetlb pages are reserved right away
+      p.slab = new packet_slab(buf_size, p.max_pkts);
+    } catch (std::bad_alloc &e) {
+      LOG(ERROR) << __FUNCTION__ << ": no slab for size class " << c;
+      p.slab_failed = true;
+    }
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    uint8_t *buf = p.slab ? p.slab->alloc() : nullptr;
+    if (buf) {
+      pkts[i] = new packet(buf, buf_size, c);
+    } else {
+      pkts[i] = new packet(get_class_size(c), c);
+    }
+    p.pktpool.push_back(pkts[i]);
+  }
+  return n;
+}
+
+bool cpacketpool::refill(enum size_class c, magazine &m) {
+  pool &p = *pools[c];
+  unsigned half = (p.mag_size + 1) / 2;
+
+  while (m.n < half && p.depot.pop(m.pkts[m.n])) {
+    m.n++;
+  }
+  if (m.n == 0) {
+    m.n = grow(c, m.pkts, half);
+  }
+  return m.n > 0;
+}
+
+void cpacketpool::flush(enum size_class c, magazine &m, unsigned n) {
+  pool &p = *pools[c];
+
+  // the depot has room for every packet of the class, it cannot be full
+  for (; n > 0 && m.n > 0; n--) {
+    p.depot.push(m.pkts[--m.n]);
   }
-  rofl::cpacket *pkt = idlepool.front();
-  idlepool.pop_front();
-  return pkt;
 }
 
-void cpacketpool::release_pkt(rofl::cpacket *pkt) {
+packet *cpacketpool::acquire_pkt(size_t size) {
+  enum size_class c = SIZE_CLASS_DEFAULT;
+  if (size > get_class_size(SIZE_CLASS_DEFAULT)) {
+    c = SIZE_CLASS_JUMBO;
+  }
+  if (size > get_class_size(c)) {
+    return nullptr;
+  }
+
+  magazine &m = cache.mags[c];
+  if (m.n == 0 && not refill(c, m)) {
+    pools[c]->exhausted++;
+    return nullptr;
+  }
+  return m.pkts[--m.n];
+}
+
+void cpacketpool::release_pkt(packet *pkt) {
   assert(pkt);
-  pkt->clear();
-  {
-    rofl::AcquireReadWriteLock rwlock(pool_rwlock);
-    idlepool.push_back(pkt);
+  assert(pkt->get_size_class() < SIZE_CLASS_MAX);
+  enum size_class c = (enum size_class)pkt->get_size_class();
+  magazine &m = cache.mags[c];
+  unsigned mag_size = pools[c]->mag_size;
+
+  pkt->reset();
+  if (m.n >= mag_size) {
+    flush(c, m, (mag_size + 1) / 2);
   }
+  m.pkts[m.n++] = pkt;
 }
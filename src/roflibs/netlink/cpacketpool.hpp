@@ -5,51 +5,157 @@
 #ifndef CPACKETPOOL_H_
 #define CPACKETPOOL_H_ 1
 
-#include <exception>
+#include <algorithm>
+#include <atomic>
 #include <vector>
-#include <deque>
 
-#include <rofl/common/cpacket.h>
 #include <rofl/common/locking.hpp>
 
+#include "roflibs/netlink/packet.hpp"
+#include "roflibs/netlink/packet_slab.hpp"
+
 namespace rofcore {
 
-class ePacketPoolBase : public std::runtime_error {
-public:
-  ePacketPoolBase(const std::string &__arg) : std::runtime_error(__arg){};
-};
-class ePacketPoolExhausted : public ePacketPoolBase {
-public:
-  ePacketPoolExhausted(const std::string &__arg) : ePacketPoolBase(__arg){};
-};
-class ePacketPoolInval : public ePacketPoolBase {
-public:
-  ePacketPoolInval(const std::string &__arg) : ePacketPoolBase(__arg){};
-};
-class ePacketPoolInvalPkt : public ePacketPoolInval {
+/**
+ * bounded lock-free multi-producer multi-consumer queue of packets
+ */
+class packet_depot {
 public:
-  ePacketPoolInvalPkt(const std::string &__arg) : ePacketPoolInval(__arg){};
+  packet_depot(size_t capacity);
+
+  ~packet_depot();
+
+  bool push(packet *pkt);
+
+  bool pop(packet *&pkt);
+
+private:
+  packet_depot(const packet_depot &) = delete;
+  packet_depot &operator=(const packet_depot &) = delete;
+
+  struct cell {
+    std::atomic<size_t> seq;
+    packet *pkt;
+  };
+
+  cell *cells;
+  size_t mask;
+  // consumers and producers on separate cache lines
+  char pad0[64];
+  std::atomic<size_t> head;
+  char pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;
 };
 
+/**
+ * packet buffers in size classes
+ *
+ * Every thread keeps a small magazine of idle packets per size class, so
+ * acquire and release usually touch no shared state at all. Magazines are
+ * refilled from and flushed to a lock-free depot. If the depot runs dry,
+ * the class grows in chunks up to its configured maximum. A magazine holds
+ * at most 1/MAGAZINE_SHARE of its class, as packets idle in the magazines
+ * of other threads count as exhausted.
+ */
 class cpacketpool {
+public:
+  enum size_class {
+    SIZE_CLASS_DEFAULT, ///< frames up to the standard mtu
+    SIZE_CLASS_JUMBO,   ///< frames up to a 9216 byte mtu
+    SIZE_CLASS_MAX,
+  };
+
+  static const unsigned MAGAZINE_SIZE = 32;
+  static const unsigned MAGAZINE_SHARE = 64;
+
+private:
   static cpacketpool *packetpool;
-  cpacketpool(unsigned int n_pkts = 256, unsigned int pkt_size = 1518);
+  cpacketpool(unsigned int n_pkts = 256, unsigned int n_jumbo_pkts = 0);
   cpacketpool(cpacketpool const &packetpool);
   ~cpacketpool();
 
-  std::vector<rofl::cpacket *> pktpool;
-  std::deque<rofl::cpacket *> idlepool;
+  struct magazine {
+    magazine() : n(0) {}
+
+    unsigned n;
+    packet *pkts[MAGAZINE_SIZE];
+  };
+
+  struct thread_cache {
+    ~thread_cache();
+
+    magazine mags[SIZE_CLASS_MAX];
+  };
+
+  static thread_local thread_cache cache;
+
+  bool refill(enum size_class c, magazine &m);
+
+  void flush(enum size_class c, magazine &m, unsigned n);
 
-  // lock for peer controllers
-  mutable rofl::crwlock pool_rwlock;
+  unsigned grow(enum size_class c, packet **pkts, unsigned n);
+
+  struct pool {
+    pool(size_t max_pkts)
+        : max_pkts(max_pkts),
+          mag_size(std::max<size_t>(
+              1, std::min<size_t>(MAGAZINE_SIZE, max_pkts / MAGAZINE_SHARE))),
+          allocated(0), exhausted(0), depot(2 * max_pkts), slab(nullptr),
+          slab_failed(false) {}
+
+    const size_t max_pkts;
+    const unsigned mag_size; // packets a magazine of the class holds
+    std::atomic<size_t> allocated;
+    std::atomic<uint64_t> exhausted;
+    packet_depot depot;
+    std::vector<packet *> pktpool; // all packets, protected by grow_rwlock
+    packet_slab *slab;             // buffers of the class, if enabled
+    bool slab_failed;              // protected by grow_rwlock
+  };
+  pool *pools[SIZE_CLASS_MAX];
+
+  // only taken when a size class grows
+  rofl::crwlock grow_rwlock;
 
 public:
   static cpacketpool &get_instance(unsigned int n_pkts = 256,
-                                   unsigned int pkt_size = 1518);
+                                   unsigned int n_jumbo_pkts = 0);
+
+  /**
+   * @return buffer size of the size class
+   */
+  static size_t get_class_size(enum size_class c);
+
+  /**
+   * acquire a packet from the smallest size class that holds size bytes
+   *
+   * @return NULL if the size class is exhausted or size is too large
+   */
+  packet *acquire_pkt(size_t size = 0);
+
+  void release_pkt(packet *pkt);
+
+  size_t get_allocated(enum size_class c) const {
+    return pools[c]->allocated;
+  }
 
-  rofl::cpacket *acquire_pkt();
+  uint64_t get_exhausted(enum size_class c) const {
+    return pools[c]->exhausted;
+  }
 
-  void release_pkt(rofl::cpacket *pkt);
+  friend std::ostream &operator<<(std::ostream &os, const cpacketpool &pool) {
+    os << "<cpacketpool>" << std::endl;
+    for (unsigned c = 0; c < SIZE_CLASS_MAX; c++) {
+      const cpacketpool::pool *p = pool.pools[c];
+      os << "<class " << get_class_size((enum size_class)c)
+         << " allocated: " << p->allocated << "/" << p->max_pkts
+         << " exhausted: " << p->exhausted << " >" << std::endl;
+      if (p->slab) {
+        os << *p->slab << std::endl;
+      }
+    }
+    return os;
+  }
 };
 
 }; // end of namespace vmcore
@@ -4,32 +4,297 @@
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/if.h>
+#include <linux/if_ether.h>
 #include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include "ctapdev.hpp"
 #include "roflibs/netlink/tap_manager.hpp"
 #include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_offload.hpp"
+
+DEFINE_int32(tap_read_budget, 32,
+             "Maximum number of frames read from a tap device per event");
+DEFINE_int32(tap_tx_queue_len, 1024,
+             "Maximum number of bulk frames queued per tap queue");
+DEFINE_int32(tap_tx_control_queue_len, 128,
+             "Maximum number of control frames queued per tap queue");
+DEFINE_bool(tap_offload, false,
+            "Accept checksum offload and TSO frames from the tap devices "
+            "and segment them in userspace");
+DEFINE_bool(tap_napi, false,
+            "Inject the frames written to the tap devices through NAPI "
+            "with GRO (IFF_NAPI)");
+DEFINE_bool(tap_napi_frags, false,
+            "With --tap_napi, write frames as page sized fragments "
+            "(IFF_NAPI_FRAGS), not with --tap_offload");
+DEFINE_bool(tap_persist, false,
+            "Keep the tap devices and their configuration when baseboxd "
+            "exits, and reattach to them on start (TUNSETPERSIST)");
 
 namespace rofcore {
 
-ctapdev::ctapdev(tap_callback &cb, std::string const &devname, pthread_t tid)
-    : fd(-1), devname(devname), thread(this), cb(cb) {
+// the kernel limit of queues per tun/tap device
+static const unsigned MAX_TAP_QUEUES = 256;
+static const size_t VLAN_HLEN = 4;
+// size of the fragments written with IFF_NAPI_FRAGS, the kernel takes at
+// most a page per fragment
+static const size_t NAPI_FRAG_SIZE = 4096;
+static const size_t NAPI_MAX_FRAGS = 16;
+
+static inline uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619;
+  }
+  return h;
+}
+
+/**
+ * hash of the addresses and ports of a frame, to keep a flow on one queue
+ */
+static uint32_t flow_hash(const uint8_t *p, size_t len) {
+  size_t off = ETH_HLEN;
+  uint32_t h = 2166136261;
+
+  if (len < ETH_HLEN) {
+    return 0;
+  }
+
+  uint16_t proto = (p[12] << 8) | p[13];
+  if (proto == ETH_P_8021Q && len >= off + 4) {
+    proto = (p[off + 2] << 8) | p[off + 3];
+    off += 4;
+  }
+
+  switch (proto) {
+  case ETH_P_IP:
+    if (len >= off + 20) {
+      size_t ihl = (p[off] & 0x0f) * 4;
+      uint8_t l4 = p[off + 9];
+      bool fragment = (p[off + 6] & 0x3f) || p[off + 7];
+
+      h = fnv1a(h, p + off + 12, 8); // saddr, daddr
+      if ((l4 == IPPROTO_TCP || l4 == IPPROTO_UDP) && not fragment &&
+          len >= off + ihl + 4) {
+        h = fnv1a(h, p + off + ihl, 4); // ports
+      }
+      return h;
+    }
+    break;
+  case ETH_P_IPV6:
+    if (len >= off + 40) {
+      uint8_t l4 = p[off + 6];
+
+      h = fnv1a(h, p + off + 8, 32); // saddr, daddr
+      if ((l4 == IPPROTO_TCP || l4 == IPPROTO_UDP) && len >= off + 44) {
+        h = fnv1a(h, p + off + 40, 4); // ports
+      }
+      return h;
+    }
+    break;
+  default:
+    break;
+  }
+
+  return fnv1a(h, p, 2 * ETH_ALEN);
+}
+
+/**
+ * control frames: link-local protocols (STP, LACP, LLDP, 802.1X) by
+ * destination, slow protocols, LLDP, EAPOL and ARP by ethertype
+ */
+static enum ctapdev::tx_class classify(const uint8_t *p, size_t len) {
+  static const uint8_t link_local[] = {0x01, 0x80, 0xc2, 0x00, 0x00};
+
+  if (len < ETH_HLEN) {
+    return ctapdev::TX_CLASS_BULK;
+  }
+
+  // 01:80:c2:00:00:0x
+  if (memcmp(p, link_local, sizeof(link_local)) == 0 && p[5] <= 0x0f) {
+    return ctapdev::TX_CLASS_CONTROL;
+  }
+
+  uint16_t proto = (p[12] << 8) | p[13];
+  if (proto == ETH_P_8021Q && len >= ETH_HLEN + 4) {
+    proto = (p[16] << 8) | p[17];
+  }
+
+  switch (proto) {
+  case ETH_P_ARP:
+  case ETH_P_SLOW:
+  case ETH_P_LLDP:
+  case ETH_P_PAE:
+    return ctapdev::TX_CLASS_CONTROL;
+  default:
+    return ctapdev::TX_CLASS_BULK;
+  }
+}
+
+static inline size_t tx_queue_len(enum ctapdev::tx_class c) {
+  int len = c == ctapdev::TX_CLASS_CONTROL ? FLAGS_tap_tx_control_queue_len
+                                           : FLAGS_tap_tx_queue_len;
+  return std::max(len, 1);
+}
+
+ctapdev::ctapdev(tap_callback &cb, std::string const &devname,
+                 std::vector<tap_io_worker *> const &workers)
+    : devname(devname), cb(cb), mtu(ETH_DATA_LEN), port_no(0), carrier(true),
+      filter(nullptr) {
   if (devname.size() > IFNAMSIZ) {
     throw std::length_error("devname.size() > IFNAMSIZ");
   }
+  if (workers.empty() || workers.size() > MAX_TAP_QUEUES) {
+    throw std::invalid_argument("invalid number of tap queues");
+  }
+
+  for (auto w : workers) {
+    queues.push_back(new tap_queue(*this, *w));
+  }
+}
+
+ctapdev::tx_counters ctapdev::get_tx_counters(enum tx_class c) const {
+  tx_counters cnt;
+  for (auto q : queues) {
+    q->get_tx_counters(c, cnt);
+  }
+  return cnt;
 }
 
 ctapdev::~ctapdev() {
-  tap_close();
-  thread.stop();
+  for (auto q : queues) {
+    delete q;
+  }
+  delete filter;
+}
+
+void ctapdev::set_filter(tap_filter *filter) {
+  delete this->filter;
+  this->filter = filter;
 }
 
 void ctapdev::tap_open() {
+  bool exists = access(("/sys/class/net/" + devname).c_str(), F_OK) == 0;
+
+  for (auto q : queues) {
+    q->open(queues.size() > 1);
+  }
+
+  if (queues.front()->is_open()) {
+    // clearing it makes a device of an earlier run go away on close again
+    queues.front()->set_persist(FLAGS_tap_persist);
+    if (exists) {
+      LOG(INFO) << __FUNCTION__ << ": reattached to " << devname;
+    }
+
+    // a new device has carrier, a reattached one may have lost it
+    if (exists || not carrier) {
+      queues.front()->set_carrier(carrier);
+    }
+  }
+
+  // the program is shared by all queues of the device
+  if (filter && not filter->empty() && queues.front()->is_open() &&
+      not filter->attach(queues.front()->get_fd())) {
+    LOG(WARNING) << __FUNCTION__ << ": " << devname
+                 << " frames are filtered in userspace";
+  }
+}
+
+void ctapdev::set_carrier(bool up) {
+  if (carrier.exchange(up) == up) {
+    return;
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": " << devname << " carrier "
+            << (up ? "up" : "down");
+  if (queues.front()->is_open()) {
+    queues.front()->set_carrier(up);
+  }
+}
+
+void ctapdev::tap_close() {
+  for (auto q : queues) {
+    q->close();
+  }
+}
+
+void ctapdev::set_mtu(unsigned mtu) {
+  if (this->mtu.exchange(mtu) == mtu) {
+    return;
+  }
+  LOG(INFO) << __FUNCTION__ << ": " << devname << " mtu=" << mtu;
+
+  size_t max_frame = mtu + ETH_HLEN + VLAN_HLEN;
+  if (max_frame >=
+          cpacketpool::get_class_size(cpacketpool::SIZE_CLASS_DEFAULT) &&
+      queues.front()->uses_uring()) {
+    LOG(WARNING) << __FUNCTION__ << ": " << devname
+                 << " frames above the default packet size are dropped "
+                    "with --tap_io_uring";
+  }
+}
+
+ctapdev::tap_queue &ctapdev::select_queue(const uint8_t *frame,
+                                          size_t len) {
+  if (queues.size() == 1) {
+    return *queues.front();
+  }
+  return *queues[flow_hash(frame, len) % queues.size()];
+}
+
+void ctapdev::enqueue(packet *pkt) {
+  select_queue(pkt->data(), pkt->length()).enqueue(pkt);
+}
+
+void ctapdev::enqueue(std::vector<packet *> pkts) {
+  for (std::vector<packet *>::iterator it = pkts.begin(); it != pkts.end();
+       ++it) {
+    enqueue(*it);
+  }
+}
+
+bool ctapdev::send(const uint8_t *frame, size_t len) {
+  return select_queue(frame, len).send(frame, len);
+}
+
+ctapdev::tap_queue::tap_queue(ctapdev &dev, tap_io_worker &worker)
+    : dev(dev), worker(worker), fd(-1), tx_busy(false), offload(false),
+      napi_frags(false), uring(false) {
+  rx_burst.reserve(std::max(FLAGS_tap_read_budget, 1));
+}
+
+ctapdev::tap_queue::~tap_queue() {
+  close();
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  for (auto &q : pout_queue) {
+    for (auto &e : q) {
+      pool.release_pkt(e.pkt);
+    }
+  }
+}
+
+void ctapdev::tap_queue::get_tx_counters(enum tx_class c,
+                                         tx_counters &cnt) const {
+  const tx_stats &s = stats[c];
+  cnt.enqueued += s.enqueued;
+  cnt.dropped += s.dropped;
+  cnt.sent += s.sent;
+  cnt.latency_us += s.latency_us;
+  cnt.latency_max_us = std::max(cnt.latency_max_us, s.latency_max_us.load());
+}
+
+void ctapdev::tap_queue::open(bool multi_queue) {
   struct ifreq ifr;
   int rc;
 
@@ -37,7 +302,7 @@ void ctapdev::tap_open() {
     return;
   }
 
-  if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
+  if ((fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0) {
     assert(0 && "CRITICAL: could not open /dev/net/tun");
   }
 
@@ -47,148 +312,493 @@ void ctapdev::tap_open() {
    *        IFF_TAP   - TAP device
    *
    *        IFF_NO_PI - Do not provide packet information
+   *        IFF_MULTI_QUEUE - Attach one more queue to the device
+   *        IFF_VNET_HDR - Prepend a virtio_net_hdr to every frame
+   *        IFF_NAPI - Inject written frames through NAPI and GRO
+   *        IFF_NAPI_FRAGS - Written iovecs become the fragments of an skb
    */
   ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-  strncpy(ifr.ifr_name, devname.c_str(), IFNAMSIZ);
+  if (multi_queue) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  offload = FLAGS_tap_offload;
+  if (offload) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+  if (FLAGS_tap_napi) {
+    ifr.ifr_flags |= IFF_NAPI;
+    napi_frags = FLAGS_tap_napi_frags && not offload;
+    if (napi_frags) {
+      ifr.ifr_flags |= IFF_NAPI_FRAGS;
+    }
+  }
+  strncpy(ifr.ifr_name, dev.devname.c_str(), IFNAMSIZ);
+
+  rc = ioctl(fd, TUNSETIFF, (void *)&ifr);
+  if (rc < 0 && (ifr.ifr_flags & IFF_NAPI)) {
+    // needs Linux >= 4.15 and CAP_NET_ADMIN
+    LOG(WARNING) << __FUNCTION__ << ": IFF_NAPI not supported on "
+                 << dev.devname << ": " << strerror(errno);
+    ifr.ifr_flags &= ~(IFF_NAPI | IFF_NAPI_FRAGS);
+    napi_frags = false;
+    rc = ioctl(fd, TUNSETIFF, (void *)&ifr);
+  }
 
-  if ((rc = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-    close(fd);
+  if (rc < 0) {
+    // a persistent device keeps the IFF_MULTI_QUEUE of its first run
+    LOG(ERROR) << __FUNCTION__ << ": TUNSETIFF " << dev.devname
+               << " failed: " << strerror(errno)
+               << (FLAGS_tap_persist ? ", delete the device if --tap_queues "
+                                       "changed"
+                                     : "");
+    ::close(fd);
     fd = -1;
     assert(0 && "CRITICAL: ioctl TUNSETIFF failed");
   }
 
-  thread.add_read_fd(fd);
-  thread.add_write_fd(fd);
-  thread.start();
+  if (offload) {
+    int hdr_len = sizeof(vnet_hdr);
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0 ||
+        ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0) {
+      // the kernel keeps segmenting and checksumming
+      LOG(WARNING) << __FUNCTION__ << ": offloads not supported on "
+                   << dev.devname << ": " << strerror(errno);
+    }
+
+    // segments of a GSO frame are appended to the burst
+    rx_burst.reserve(std::max(FLAGS_tap_read_budget, 1) +
+                     TAP_GSO_MAX_FRAME / ETH_DATA_LEN + 1);
+    overflow.resize(TAP_GSO_MAX_FRAME);
+  }
+
+  // frames with a virtio_net_hdr are read through the epoll path only
+  uring = worker.add(this, fd, not offload);
 }
 
-void ctapdev::tap_close() {
+void ctapdev::tap_queue::set_persist(bool persist) {
+  if (ioctl(fd, TUNSETPERSIST, persist ? 1 : 0) < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": TUNSETPERSIST " << dev.devname
+                 << " failed: " << strerror(errno);
+  }
+}
+
+void ctapdev::tap_queue::set_carrier(bool up) {
+  int on = up ? 1 : 0;
+  if (ioctl(fd, TUNSETCARRIER, &on) < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": TUNSETCARRIER " << dev.devname
+                 << " failed: " << strerror(errno);
+  }
+}
+
+void ctapdev::tap_queue::close() {
   if (fd == -1) {
     return;
   }
 
-  thread.drop_read_fd(fd, false);
-  thread.drop_write_fd(fd, false);
+  worker.del(this, fd);
 
-  close(fd);
+  ::close(fd);
 
   fd = -1;
 }
 
-void ctapdev::enqueue(rofl::cpacket *pkt) {
+void ctapdev::tap_queue::enqueue(packet *pkt) {
   if (fd == -1) {
     cpacketpool::get_instance().release_pkt(pkt);
     return;
   }
 
+  enum tx_class c = classify(pkt->data(), pkt->length());
+  bool full;
+
   // store pkt in outgoing queue
   {
     rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
-    pout_queue.push_back(pkt);
+    full = pout_queue[c].size() >= tx_queue_len(c);
+    if (not full) {
+      pout_queue[c].push_back({pkt, std::chrono::steady_clock::now()});
+    }
+  }
+
+  if (full) {
+    // tail drop
+    stats[c].dropped++;
+    cpacketpool::get_instance().release_pkt(pkt);
+    return;
   }
 
-  thread.wakeup();
+  stats[c].enqueued++;
+  worker.notify_write(this);
 }
 
-void ctapdev::enqueue(std::vector<rofl::cpacket *> pkts) {
-  if (fd == -1) {
-    for (std::vector<rofl::cpacket *>::iterator it = pkts.begin();
-         it != pkts.end(); ++it) {
-      cpacketpool::get_instance().release_pkt((*it));
-    }
-    return;
+bool ctapdev::tap_queue::send(const uint8_t *frame, size_t len) {
+  if (fd == -1 || uring) {
+    return false;
   }
 
-  // store pkts in outgoing queue
-  {
-    rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
-    for (std::vector<rofl::cpacket *>::iterator it = pkts.begin();
-         it != pkts.end(); ++it) {
-      pout_queue.push_back(*it);
-    }
+  enum tx_class c = classify(frame, len);
+
+  // the lock keeps the worker from sending queued frames meanwhile, the
+  // write does not block
+  rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
+  if (tx_busy || not pout_queue[TX_CLASS_CONTROL].empty() ||
+      not pout_queue[c].empty()) {
+    return false;
   }
 
-  thread.wakeup();
-}
+  int rc = tx(frame, len);
+  if (rc < 0 && errno == EAGAIN) {
+    return false;
+  }
 
-void ctapdev::handle_read_event(rofl::cthread &thread, int fd) {
-  rofl::cpacket *pkt = NULL;
-  try {
+  stats[c].enqueued++;
+  if (rc >= 0) {
+    stats[c].sent++;
+    return true;
+  }
 
-    rofl::cmemory mem(1518);
+  stats[c].dropped++;
+  if (errno != EIO) {
+    LOG(ERROR) << __FUNCTION__ << ": " << dev.devname << " write failed: "
+               << strerror(errno);
+  }
+  return true;
+}
 
-    int rc = read(fd, mem.somem(), mem.memlen());
+bool ctapdev::tap_queue::handle_read() {
+  cpacketpool &pool = cpacketpool::get_instance();
+  bool more = true;
+
+  // drain up to the budget, the worker returns when the other queues had
+  // their turn
+  for (int i = 0; i < std::max(FLAGS_tap_read_budget, 1); i++) {
+    // the frame is read in place into the pooled buffer
+    packet *pkt = pool.acquire_pkt();
+    if (pkt == NULL) {
+      LOG_EVERY_N(ERROR, 1000) << "ctapdev::handle_revent() packet pool "
+                                  "exhausted, no idle slots available";
+
+      // a short read consumes and drops the frame
+      uint8_t discard[ETH_HLEN];
+      if (read(fd, discard, sizeof(discard)) < 0) {
+        if (errno != EAGAIN) {
+          LOG(ERROR) << "ctapdev::handle_revent() error occured" << std::endl;
+        }
+        // drained, wait for the next event instead of polling
+        more = false;
+      }
+      break;
+    }
 
-    // error occured (or non-blocking)
+    int rc = offload ? rx_vnet(pkt) : rx(pkt);
     if (rc < 0) {
+      pool.release_pkt(pkt);
       switch (errno) {
       case EAGAIN:
-        LOG(ERROR) << "ctapdev::handle_revent() EAGAIN, retrying later"
-                   << std::endl;
+        // drained
+        break;
+      case EINTR:
+        continue;
       default:
-        LOG(ERROR) << "ctapdev::handle_revent() error occured" << std::endl;
+        LOG(ERROR) << "ctapdev::handle_revent() error occured errno="
+                   << errno << " '" << strerror(errno) << "'" << std::endl;
+        break;
       }
-    } else {
-      pkt = cpacketpool::get_instance().acquire_pkt();
+      more = false;
+      break;
+    }
+  }
 
-      pkt->unpack(mem.somem(), rc);
+  deliver();
+  return more;
+}
+
+void ctapdev::tap_queue::handle_frame(packet *pkt) {
+  // the kernel cuts frames at the end of the buffer
+  if (pkt->length() >= pkt->capacity()) {
+    VLOG(1) << __FUNCTION__ << ": dropping truncated frame on "
+            << dev.devname;
+    cpacketpool::get_instance().release_pkt(pkt);
+    return;
+  }
+  rx_burst.push_back(pkt);
+}
 
-      cb.enqueue(this, pkt);
+void ctapdev::tap_queue::handle_frames_done() { deliver(); }
+
+void ctapdev::tap_queue::deliver() {
+  tap_filter *filter = dev.filter;
+
+  if (filter && not filter->in_kernel()) {
+    cpacketpool &pool = cpacketpool::get_instance();
+    auto last = std::remove_if(
+        rx_burst.begin(), rx_burst.end(), [filter, &pool](packet *pkt) {
+          if (filter->accept(pkt->data(), pkt->length())) {
+            return false;
+          }
+          pool.release_pkt(pkt);
+          return true;
+        });
+    rx_burst.erase(last, rx_burst.end());
+  }
+
+  if (not rx_burst.empty()) {
+    dev.cb.enqueue(&dev, rx_burst);
+    rx_burst.clear();
+  }
+}
+
+int ctapdev::tap_queue::rx(packet *pkt) {
+  size_t cap = pkt->capacity();
+  size_t max_frame = dev.get_mtu() + ETH_HLEN + VLAN_HLEN;
+  int rc;
+
+  if (max_frame <= cap) {
+    rc = read(fd, pkt->data(), cap);
+  } else {
+    // jumbo frames continue in overflow behind the space of the first part
+    if (overflow.size() < max_frame) {
+      overflow.resize(max_frame);
     }
+    struct iovec iov[] = {
+        {pkt->data(), cap},
+        {overflow.data() + cap, overflow.size() - cap},
+    };
+    rc = readv(fd, iov, sizeof(iov) / sizeof(iov[0]));
+  }
 
-  } catch (ePacketPoolExhausted &e) {
-    LOG(ERROR) << "ctapdev::handle_revent() packet pool "
-                  "exhausted, no idle slots available"
-               << std::endl;
+  if (rc < 0) {
+    return rc;
+  }
+
+  if ((size_t)rc > cap) {
+    pkt = rx_jumbo(pkt, rc);
+    if (pkt == NULL) {
+      return rc;
+    }
+  } else {
+    pkt->set_length(rc);
   }
+  rx_burst.push_back(pkt);
+  return rc;
 }
 
-void ctapdev::handle_write_event(rofl::cthread &thread, int fd) { tx(); }
+packet *ctapdev::tap_queue::rx_jumbo(packet *pkt, size_t len) {
+  cpacketpool &pool = cpacketpool::get_instance();
+  packet *jumbo = pool.acquire_pkt(len);
+
+  if (jumbo) {
+    size_t cap = pkt->capacity();
+    memcpy(jumbo->data(), pkt->data(), cap);
+    memcpy(jumbo->data() + cap, overflow.data() + cap, len - cap);
+    jumbo->set_length(len);
+  } else {
+    LOG(ERROR) << __FUNCTION__ << ": dropping frame of " << len << " bytes";
+  }
+
+  pool.release_pkt(pkt);
+  return jumbo;
+}
+
+int ctapdev::tap_queue::rx_vnet(packet *pkt) {
+  vnet_hdr hdr;
+  size_t cap = pkt->capacity();
+
+  // frames up to the packet size are read in place, the rest of a jumbo or
+  // GSO frame goes into overflow behind the space of the first part
+  struct iovec iov[] = {
+      {&hdr, sizeof(hdr)},
+      {pkt->data(), cap},
+      {overflow.data() + cap, overflow.size() - cap},
+  };
+
+  int rc = readv(fd, iov, sizeof(iov) / sizeof(iov[0]));
+  if (rc < 0) {
+    return rc;
+  }
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  size_t len = (size_t)rc > sizeof(hdr) ? rc - sizeof(hdr) : 0;
+
+  if (hdr.gso_type == vnet_hdr::GSO_NONE) {
+    if (len > cap) {
+      pkt = rx_jumbo(pkt, len);
+      if (pkt == NULL) {
+        return rc;
+      }
+    } else {
+      pkt->set_length(len);
+    }
+
+    if ((hdr.flags & vnet_hdr::F_NEEDS_CSUM) &&
+        not tap_csum_complete(pkt->data(), len, hdr)) {
+      LOG(WARNING) << __FUNCTION__ << ": bad checksum offsets, dropping";
+      pool.release_pkt(pkt);
+      return rc;
+    }
+    rx_burst.push_back(pkt);
+    return rc;
+  }
+
+  // make the frame contiguous and cut it into segments
+  memcpy(overflow.data(), pkt->data(), std::min(len, cap));
+  pool.release_pkt(pkt);
+
+  if (tap_gso_segment(overflow.data(), len, hdr, rx_burst) == 0) {
+    LOG(WARNING) << __FUNCTION__ << ": dropping unsupported frame of " << len
+                 << " bytes, gso_type=" << (int)hdr.gso_type;
+  }
+  return rc;
+}
+
+int ctapdev::tap_queue::tx(const uint8_t *frame, size_t len) {
+  if (napi_frags && len > ETH_HLEN) {
+    return tx_frags(frame, len);
+  }
+
+  if (not offload) {
+    return write(fd, frame, len);
+  }
+
+  // nothing to offload towards the host
+  static const vnet_hdr hdr = {};
+  struct iovec iov[] = {
+      {const_cast<vnet_hdr *>(&hdr), sizeof(hdr)},
+      {const_cast<uint8_t *>(frame), len},
+  };
+  return writev(fd, iov, sizeof(iov) / sizeof(iov[0]));
+}
 
-static inline void release_packets(std::deque<rofl::cpacket *> &q) {
-  for (auto i : q) {
-    cpacketpool::get_instance().release_pkt(i);
+int ctapdev::tap_queue::tx_frags(const uint8_t *frame, size_t len) {
+  // the first iovec is the linear part of the skb, GRO finds the
+  // Ethernet header there
+  struct iovec iov[NAPI_MAX_FRAGS + 1];
+  int n = 0;
+
+  iov[n++] = {const_cast<uint8_t *>(frame), ETH_HLEN};
+  for (size_t off = ETH_HLEN; off < len && n <= (int)NAPI_MAX_FRAGS;
+       off += NAPI_FRAG_SIZE) {
+    iov[n++] = {const_cast<uint8_t *>(frame) + off,
+                std::min(NAPI_FRAG_SIZE, len - off)};
   }
+  return writev(fd, iov, n);
 }
 
-void ctapdev::tx() {
-  rofl::cpacket *pkt = NULL;
-  std::deque<rofl::cpacket *> out_queue;
+void ctapdev::tap_queue::tx_sent(
+    enum tx_class c, std::chrono::steady_clock::time_point queued) {
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - queued)
+                    .count();
+  tx_stats &s = stats[c];
+
+  // the worker is the only writer
+  s.sent++;
+  s.latency_us += us;
+  if (us > s.latency_max_us) {
+    s.latency_max_us = us;
+  }
+}
+
+void ctapdev::tap_queue::handle_write_done(tap_io_write &w, int res) {
+  enum tx_class c = (enum tx_class)w.tag;
+  if (res >= 0) {
+    tx_sent(c, w.queued);
+  } else {
+    stats[c].dropped++;
+  }
+  cpacketpool::get_instance().release_pkt(w.pkt);
+}
+
+void ctapdev::tap_queue::tx_drop(enum tx_class c, std::deque<tx_entry> &q) {
+  cpacketpool &pool = cpacketpool::get_instance();
+  stats[c].dropped += q.size();
+  for (auto &e : q) {
+    pool.release_pkt(e.pkt);
+  }
+  q.clear();
+}
+
+void ctapdev::tap_queue::tx() {
+  std::deque<tx_entry> out_queue[TX_CLASS_MAX];
 
   {
     rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
-    out_queue = std::move(pout_queue);
+    for (unsigned c = 0; c < TX_CLASS_MAX; c++) {
+      out_queue[c].swap(pout_queue[c]);
+    }
+    tx_busy = true;
   }
 
-  while (not out_queue.empty()) {
+  tx(out_queue);
+
+  rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
+  tx_busy = false;
+}
+
+void ctapdev::tap_queue::tx(std::deque<tx_entry> *out_queue) {
+  // strict priority, control frames first
+  for (unsigned i = 0; i < TX_CLASS_MAX; i++) {
+    enum tx_class c = (enum tx_class)i;
+    std::deque<tx_entry> &q = out_queue[c];
+
+    if (uring) {
+      // one submission for the whole queue, accounted on completion
+      std::deque<tap_io_write> writes;
+      for (auto &e : q) {
+        writes.push_back(tap_io_write{e.pkt, c, e.queued});
+      }
+      q.clear();
+      worker.submit_writes(this, fd, writes);
+      continue;
+    }
+
+    while (not q.empty()) {
+      int rc = tx(q.front().pkt->data(), q.front().pkt->length());
+      if (rc >= 0) {
+        tx_sent(c, q.front().queued);
+        cpacketpool::get_instance().release_pkt(q.front().pkt);
+        q.pop_front();
+        continue;
+      }
 
-    pkt = out_queue.front();
-    int rc = 0;
-    if ((rc = write(fd, pkt->soframe(), pkt->length())) < 0) {
       switch (errno) {
-      case EAGAIN:
+      case EAGAIN: {
         VLOG(1) << "ctapdev::tx() EAGAIN" << std::endl;
-        {
-          rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
-          std::move(out_queue.rbegin(), out_queue.rend(),
-                    std::front_inserter(pout_queue));
+
+        // retried on the next write event, ahead of newer frames
+        rofl::AcquireReadWriteLock rwlock(pout_queue_rwlock);
+        for (unsigned j = i; j < TX_CLASS_MAX; j++) {
+          std::deque<tx_entry> &pq = pout_queue[j];
+          std::move(out_queue[j].rbegin(), out_queue[j].rend(),
+                    std::front_inserter(pq));
+          out_queue[j].clear();
+
+          // tail drop what does not fit anymore
+          size_t len = tx_queue_len((enum tx_class)j);
+          while (pq.size() > len) {
+            stats[j].dropped++;
+            cpacketpool::get_instance().release_pkt(pq.back().pkt);
+            pq.pop_back();
+          }
         }
         return;
+      }
       case EIO:
-        // tap not enabled drop packet
-        release_packets(out_queue);
+        // tap not enabled, drop the queued frames
+        for (unsigned j = i; j < TX_CLASS_MAX; j++) {
+          tx_drop((enum tx_class)j, out_queue[j]);
+        }
         return;
       default:
-        // will drop packets
-        release_packets(out_queue);
         LOG(ERROR) << "ctapdev::tx() unknown error occured rc=" << rc
                    << " errno=" << errno << " '" << strerror(errno)
                    << std::endl;
+        for (unsigned j = i; j < TX_CLASS_MAX; j++) {
+          tx_drop((enum tx_class)j, out_queue[j]);
+        }
         return;
       }
     }
-    cpacketpool::get_instance().release_pkt(pkt);
-    out_queue.pop_front();
   }
 }
 
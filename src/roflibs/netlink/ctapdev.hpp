@@ -5,36 +5,194 @@
 #ifndef CTAPDEV_H_
 #define CTAPDEV_H_ 1
 
+#include <atomic>
+#include <chrono>
 #include <deque>
 #include <exception>
+#include <ostream>
+#include <vector>
 
-#include <rofl/common/cthread.hpp>
-#include <rofl/common/cpacket.h>
+#include <rofl/common/locking.hpp>
+
+#include "roflibs/netlink/packet.hpp"
+#include "roflibs/netlink/tap_filter.hpp"
+#include "roflibs/netlink/tap_io.hpp"
 
 namespace rofcore {
 
 class tap_callback;
 
-class ctapdev : public rofl::cthread_env {
+class ctapdev {
+public:
+  /**
+   * egress classes, control frames are sent before any bulk frame
+   */
+  enum tx_class {
+    TX_CLASS_CONTROL, ///< link-local protocols, ARP
+    TX_CLASS_BULK,
+    TX_CLASS_MAX,
+  };
 
-  int fd;                                 // tap device file descriptor
-  std::deque<rofl::cpacket *> pout_queue; // queue of outgoing packets
-  mutable rofl::crwlock pout_queue_rwlock;
-  std::string devname;
-  rofl::cthread thread;
-  tap_callback &cb;
+  struct tx_counters {
+    tx_counters()
+        : enqueued(0), dropped(0), sent(0), latency_us(0), latency_max_us(0) {
+    }
 
-  enum ctapdev_timer_t {
-    CTAPDEV_TIMER_OPEN_PORT = 1,
+    uint64_t enqueued;
+    uint64_t dropped; // queue full, or the write failed
+    uint64_t sent;
+    uint64_t latency_us; // sum over the sent frames
+    uint64_t latency_max_us;
   };
 
+private:
+  /**
+   * one queue of the tap device, served by a tap_io_worker
+   */
+  class tap_queue : public tap_io_handler {
+  public:
+    tap_queue(ctapdev &dev, tap_io_worker &worker);
+
+    ~tap_queue();
+
+    void open(bool multi_queue);
+
+    void close();
+
+    bool is_open() const { return fd != -1; }
+
+    int get_fd() const { return fd; }
+
+    /**
+     * keep the device when the last queue is closed
+     */
+    void set_persist(bool persist);
+
+    /**
+     * operational state of the device as seen by the kernel
+     */
+    void set_carrier(bool up);
+
+    void enqueue(packet *pkt);
+
+    /**
+     * write a borrowed frame right away if nothing is queued before it
+     *
+     * @return false if the frame has to be queued
+     */
+    bool send(const uint8_t *frame, size_t len);
+
+    bool handle_read() override;
+
+    void handle_write() override { tx(); }
+
+    void handle_frame(packet *pkt) override;
+
+    void handle_frames_done() override;
+
+    void handle_write_done(tap_io_write &w, int res) override;
+
+    void handle_uring_fallback() override { uring = false; }
+
+    bool uses_uring() const { return uring; }
+
+    void get_tx_counters(enum tx_class c, tx_counters &cnt) const;
+
+  protected:
+    void tx();
+
+    /**
+     * hand rx_burst to the callback, after the filter if it is not
+     * evaluated by the kernel
+     */
+    void deliver();
+
+    /**
+     * read one frame into pkt and append the result to rx_burst
+     *
+     * @return result of the read, pkt is owned by the caller if negative
+     */
+    int rx(packet *pkt);
+
+    int rx_vnet(packet *pkt);
+
+    /**
+     * move a frame split between pkt and overflow to a jumbo packet
+     *
+     * @return the jumbo packet or NULL, pkt is released in any case
+     */
+    packet *rx_jumbo(packet *pkt, size_t len);
+
+    int tx(const uint8_t *frame, size_t len);
+
+    /**
+     * write the frame as page sized fragments, with IFF_NAPI_FRAGS
+     */
+    int tx_frags(const uint8_t *frame, size_t len);
+
+    struct tx_entry {
+      packet *pkt;
+      std::chrono::steady_clock::time_point queued;
+    };
+
+    /**
+     * send the frames taken from pout_queue, one deque per class
+     */
+    void tx(std::deque<tx_entry> *out_queue);
+
+    /**
+     * account a frame written to the kernel, the caller releases it
+     */
+    void tx_sent(enum tx_class c,
+                 std::chrono::steady_clock::time_point queued);
+
+    void tx_drop(enum tx_class c, std::deque<tx_entry> &q);
+
+  private:
+    struct tx_stats {
+      tx_stats()
+          : enqueued(0), dropped(0), sent(0), latency_us(0),
+            latency_max_us(0) {}
+
+      std::atomic<uint64_t> enqueued;
+      std::atomic<uint64_t> dropped;
+      std::atomic<uint64_t> sent;
+      std::atomic<uint64_t> latency_us;
+      std::atomic<uint64_t> latency_max_us;
+    };
+
+    ctapdev &dev;
+    tap_io_worker &worker;
+    int fd;                          // tap queue file descriptor
+    std::deque<tx_entry> pout_queue[TX_CLASS_MAX]; // outgoing packets
+    mutable rofl::crwlock pout_queue_rwlock;
+    bool tx_busy; // tx() sends taken frames, under pout_queue_rwlock
+    tx_stats stats[TX_CLASS_MAX];
+    std::vector<packet *> rx_burst; // frames of the current read event
+    bool offload;                  // frames carry a virtio_net_hdr
+    bool napi_frags;               // written as fragments, IFF_NAPI_FRAGS
+    bool uring;                    // served by the io_uring of the worker
+    std::vector<uint8_t> overflow; // frames exceeding the packet size
+  };
+
+  std::string devname;
+  tap_callback &cb;
+  std::atomic<unsigned> mtu;
+  std::atomic<uint32_t> port_no;
+  std::atomic<bool> carrier;
+  std::vector<tap_queue *> queues;
+  tap_filter *filter;
+
 public:
   /**
    *
-   * @param netdev_owner
+   * @param cb receives the frames read from the device
    * @param devname
+   * @param workers serve one queue each, more than one enables
+   * IFF_MULTI_QUEUE
    */
-  ctapdev(tap_callback &cb, std::string const &devname, pthread_t tid = 0);
+  ctapdev(tap_callback &cb, std::string const &devname,
+          std::vector<tap_io_worker *> const &workers);
 
   /**
    *
@@ -43,41 +201,106 @@ public:
 
   const std::string &get_devname() const { return devname; }
 
+  unsigned get_n_queues() const { return queues.size(); }
+
   /**
-   * @brief	Enqueues a single rofl::cpacket instance on cnetdev.
+   * frames are read into the packet size class fitting the mtu
+   */
+  void set_mtu(unsigned mtu);
+
+  unsigned get_mtu() const { return mtu; }
+
+  /**
+   * OpenFlow port of the device, cached for the packet-out path
    *
-   * rofl::cpacket instance must have been allocated on heap and must
-   * be removed
+   * @return the port number or 0 if it is not resolved
    */
-  virtual void enqueue(rofl::cpacket *pkt);
+  uint32_t get_port_no() const { return port_no; }
 
-  virtual void enqueue(std::vector<rofl::cpacket *> pkts);
+  void set_port_no(uint32_t port_no) { this->port_no = port_no; }
 
   /**
-   * @brief	open tapX device
+   * mirror the link state of the switch port (TUNSETCARRIER, Linux >= 5.0)
+   *
+   * Without carrier the kernel takes the device out of its bridge and
+   * routes. The state is kept and applied again on tap_open.
    */
-  void tap_open();
+  void set_carrier(bool up);
+
+  bool has_carrier() const { return carrier; }
 
   /**
-   * @brief	close tapX device
+   * filter the frames read from the device, attached on tap_open
    *
+   * @param filter owned by the device
    */
-  void tap_close();
+  void set_filter(tap_filter *filter);
+
+  /**
+   * @return counters of the class summed over all queues
+   */
+  tx_counters get_tx_counters(enum tx_class c) const;
+
+  /**
+   * @brief	Enqueues a single packet instance on cnetdev.
+   *
+   * packet instance must have been acquired from the cpacketpool, it is
+   * released after it was sent. Frames of the same flow are sent on the
+   * same queue, so their order is kept. A frame is dropped if the queue of
+   * its class is full.
+   */
+  virtual void enqueue(packet *pkt);
 
-protected:
-  void tx();
+  virtual void enqueue(std::vector<packet *> pkts);
 
   /**
-   * @brief	handle read events on file descriptor
+   * write a frame from a buffer owned by the caller
+   *
+   * The frame is written right away if no frame of the queue is waiting
+   * before it, which spares copying it to a pooled packet.
+   *
+   * @return false if the frame was not consumed and has to be enqueued
    */
-  virtual void handle_read_event(rofl::cthread &thread, int fd);
+  bool send(const uint8_t *frame, size_t len);
 
   /**
-   * @brief	handle write events on file descriptor
+   * @brief	open tapX device
+   *
+   * An existing device is reattached. With --tap_persist it outlives
+   * tap_close() along with its addresses, bridge port and VLANs.
    */
-  virtual void handle_write_event(rofl::cthread &thread, int fd);
+  void tap_open();
+
+  /**
+   * @brief	close tapX device
+   *
+   */
+  void tap_close();
+
+  friend std::ostream &operator<<(std::ostream &os, const ctapdev &dev) {
+    static const char *names[TX_CLASS_MAX] = {"control", "bulk"};
+
+    os << "<ctapdev " << dev.devname << " tx";
+    for (unsigned c = 0; c < TX_CLASS_MAX; c++) {
+      tx_counters cnt = dev.get_tx_counters((enum tx_class)c);
+      os << " " << names[c] << ": " << cnt.sent << "/" << cnt.enqueued
+         << " sent, " << cnt.dropped << " dropped, latency avg "
+         << (cnt.sent ? cnt.latency_us / cnt.sent : 0) << "us max "
+         << cnt.latency_max_us << "us";
+    }
+    if (dev.filter && not dev.filter->empty()) {
+      os << " filter" << (dev.filter->in_kernel() ? " (bpf): " : ": ")
+         << *dev.filter;
+    }
+    os << ">";
+    return os;
+  }
+
+private:
+  ctapdev(const ctapdev &) = delete;
+  ctapdev &operator=(const ctapdev &) = delete;
 
-  virtual void handle_wakeup(rofl::cthread &thread) { tx(); }
+  tap_queue &select_queue(const uint8_t *frame, size_t len);
 };
 
 } // end of namespace rofcore
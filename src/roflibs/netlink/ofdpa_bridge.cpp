@@ -331,9 +331,9 @@ void ofdpa_bridge::delete_interface(uint32_t port, const crtlink &rtl) {
 }
 
 void ofdpa_bridge::add_mac_to_fdb(const uint32_t port, const uint16_t vid,
-                                  const rofl::cmacaddr &mac) {
+                                  const rofl::cmacaddr &mac, bool learned) {
   assert(sw);
-  sw->l2_addr_add(port, vid, mac, egress_vlan_filtered);
+  sw->l2_addr_add(port, vid, mac, egress_vlan_filtered, learned);
 }
 
 void ofdpa_bridge::remove_mac_from_fdb(const uint32_t port, uint16_t vid,
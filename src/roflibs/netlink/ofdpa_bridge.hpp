@@ -34,7 +34,7 @@ public:
   void delete_interface(uint32_t port, const rofcore::crtlink &rtl);
 
   void add_mac_to_fdb(const uint32_t port, const uint16_t vid,
-                      const rofl::cmacaddr &mac);
+                      const rofl::cmacaddr &mac, bool learned);
 
   void remove_mac_from_fdb(const uint32_t port, uint16_t vid,
                            const rofl::cmacaddr &mac);
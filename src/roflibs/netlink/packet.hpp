@@ -0,0 +1,124 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+namespace rofcore {
+
+/**
+ * frame buffer owned by the cpacketpool
+ *
+ * The buffer is allocated once with the pool, either on its own or carved
+ * from a packet_slab. The frame starts after a headroom, so tags can be
+ * pushed in front of it without moving the payload, and the tap devices
+ * read and write the frame in place.
+ */
+class packet {
+public:
+  static const size_t HEADROOM = 8; // two vlan tags
+
+  packet(size_t size, unsigned size_class = 0)
+      : buf(new uint8_t[HEADROOM + size]), size(HEADROOM + size),
+        offset(HEADROOM), len(0), size_class(size_class), owned(true) {}
+
+  /**
+   * wrap a buffer of size bytes, including the headroom, owned by a slab
+   */
+  packet(uint8_t *buf, size_t size, unsigned size_class)
+      : buf(buf), size(size), offset(HEADROOM), len(0),
+        size_class(size_class), owned(false) {
+    assert(size > HEADROOM);
+  }
+
+  ~packet() {
+    if (owned) {
+      delete[] buf;
+    }
+  }
+
+  uint8_t *data() { return buf + offset; }
+
+  const uint8_t *data() const { return buf + offset; }
+
+  size_t length() const { return len; }
+
+  /**
+   * @return space available for the frame starting at data()
+   */
+  size_t capacity() const { return size - offset; }
+
+  size_t headroom() const { return offset; }
+
+  /**
+   * @return pool size class the buffer belongs to
+   */
+  unsigned get_size_class() const { return size_class; }
+
+  void set_length(size_t len) {
+    assert(len <= capacity());
+    this->len = len;
+  }
+
+  /**
+   * copy a frame into the buffer
+   *
+   * @return false if the frame does not fit
+   */
+  bool assign(const uint8_t *frame, size_t len) {
+    if (len > capacity()) {
+      return false;
+    }
+    memcpy(data(), frame, len);
+    this->len = len;
+    return true;
+  }
+
+  /**
+   * prepend n bytes in the headroom
+   */
+  uint8_t *push(size_t n) {
+    assert(n <= offset);
+    offset -= n;
+    len += n;
+    return data();
+  }
+
+  /**
+   * strip n bytes from the front
+   */
+  uint8_t *pull(size_t n) {
+    assert(n <= len);
+    offset += n;
+    len -= n;
+    return data();
+  }
+
+  void reset() {
+    offset = HEADROOM;
+    len = 0;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const packet &pkt) {
+    os << "<packet len=" << pkt.len << " headroom=" << pkt.offset << ">";
+    return os;
+  }
+
+private:
+  packet(const packet &) = delete;
+  packet &operator=(const packet &) = delete;
+
+  uint8_t *buf;
+  size_t size;
+  size_t offset;
+  size_t len;
+  unsigned size_class;
+  bool owned;
+};
+
+} // namespace rofcore
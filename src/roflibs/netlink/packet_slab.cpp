@@ -0,0 +1,80 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/packet_slab.hpp"
+
+namespace rofcore {
+
+packet_slab::packet_slab(size_t buf_size, size_t n_bufs)
+    : base(nullptr), mapped(0), buf_size(buf_size), n_bufs(n_bufs),
+      n_used(0), hugetlb(true), node(-1) {
+  mapped = (buf_size * n_bufs + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+
+  void *p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    VLOG(1) << __FUNCTION__ << ": no hugetlb pages (" << strerror(errno)
+            << "), using regular pages";
+    hugetlb = false;
+    p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      LOG(ERROR) << __FUNCTION__ << ": mmap of " << mapped
+                 << " bytes failed: " << strerror(errno);
+      throw std::bad_alloc();
+    }
+    madvise(p, mapped, MADV_HUGEPAGE);
+  }
+  base = static_cast<uint8_t *>(p);
+
+  // before the first touch, which places the pages
+  bind_local_node();
+
+  LOG(INFO) << __FUNCTION__ << ": " << *this;
+}
+
+packet_slab::~packet_slab() { munmap(base, mapped); }
+
+void packet_slab::bind_local_node() {
+  unsigned cpu, n;
+  if (syscall(SYS_getcpu, &cpu, &n, NULL) < 0) {
+    return;
+  }
+
+  unsigned long nodemask[4] = {0};
+  const unsigned long maxnode = sizeof(nodemask) * 8;
+  if (n >= maxnode) {
+    return;
+  }
+  nodemask[n / (sizeof(unsigned long) * 8)] |=
+      1UL << (n % (sizeof(unsigned long) * 8));
+
+  // preferred, so a full node still falls back to the others
+  if (syscall(SYS_mbind, base, mapped, MPOL_PREFERRED, nodemask, maxnode, 0) <
+      0) {
+    VLOG(1) << __FUNCTION__ << ": mbind failed: " << strerror(errno);
+    return;
+  }
+  node = n;
+}
+
+uint8_t *packet_slab::alloc() {
+  if (n_used == n_bufs) {
+    return nullptr;
+  }
+  return base + buf_size * n_used++;
+}
+
+} // namespace rofcore
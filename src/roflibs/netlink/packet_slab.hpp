@@ -0,0 +1,70 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace rofcore {
+
+/**
+ * contiguous region of fixed size packet buffers
+ *
+ * The region is mapped with hugepages if the system has them reserved,
+ * otherwise with regular pages and transparent hugepages requested. The
+ * hugepages of the whole region are reserved by the mapping, regular pages
+ * are only faulted in as buffers are used. Memory is placed on the NUMA
+ * node of the thread creating the slab. Buffers are carved in order and
+ * never returned, the cpacketpool recycles the packets owning them.
+ */
+class packet_slab {
+public:
+  static const size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+  packet_slab(size_t buf_size, size_t n_bufs);
+
+  ~packet_slab();
+
+  /**
+   * @return next unused buffer, NULL if the slab is full
+   */
+  uint8_t *alloc();
+
+  size_t get_buf_size() const { return buf_size; }
+
+  size_t get_n_bufs() const { return n_bufs; }
+
+  size_t get_n_used() const { return n_used; }
+
+  bool is_hugetlb() const { return hugetlb; }
+
+  friend std::ostream &operator<<(std::ostream &os, const packet_slab &slab) {
+    os << "<packet_slab " << slab.n_used << "/" << slab.n_bufs << " bufs of "
+       << slab.buf_size << " bytes, " << (slab.mapped >> 10) << "KiB "
+       << (slab.hugetlb ? "hugetlb" : "regular pages");
+    if (slab.node >= 0) {
+      os << " on node " << slab.node;
+    }
+    os << ">";
+    return os;
+  }
+
+private:
+  packet_slab(const packet_slab &) = delete;
+  packet_slab &operator=(const packet_slab &) = delete;
+
+  void bind_local_node();
+
+  uint8_t *base;
+  size_t mapped;
+  size_t buf_size;
+  size_t n_bufs;
+  size_t n_used;
+  bool hugetlb;
+  int node;
+};
+
+} // namespace rofcore
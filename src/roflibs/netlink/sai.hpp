@@ -13,8 +13,8 @@ public:
   virtual int l2_addr_remove_all_in_vlan(uint32_t port,
                                          uint16_t vid) noexcept = 0;
   virtual int l2_addr_add(uint32_t port, uint16_t vid,
-                          const rofl::cmacaddr &mac,
-                          bool filtered) noexcept = 0;
+                          const rofl::cmacaddr &mac, bool filtered,
+                          bool learned) noexcept = 0;
   virtual int l2_addr_remove(uint32_t port, uint16_t vid,
                              const rofl::cmacaddr &mac) noexcept = 0;
 
@@ -39,5 +39,13 @@ class nbi {
 public:
   virtual void register_switch(switch_interface *) noexcept = 0;
   virtual void resend_state() noexcept = 0;
+
+  /**
+   * the switch channel is congested, stop pushing updates until
+   * congestion_solved() is called. pending updates are held back and
+   * coalesced meanwhile.
+   */
+  virtual void congestion_occured() noexcept = 0;
+  virtual void congestion_solved() noexcept = 0;
 };
 } // namespace rofcore
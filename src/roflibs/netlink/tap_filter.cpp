@@ -0,0 +1,352 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/tap_filter.hpp"
+
+namespace rofcore {
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static inline uint64_t ptr_to_u64(const void *p) {
+  return (uint64_t)(uintptr_t)p;
+}
+
+std::vector<tap_filter::rule> tap_filter::parse(const std::string &spec) {
+  std::vector<rule> rules;
+  std::istringstream ss(spec);
+  std::string text;
+
+  while (std::getline(ss, text, ',')) {
+    if (text.empty()) {
+      continue;
+    }
+
+    size_t colon = text.find(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("tap filter rule without action: " + text);
+    }
+
+    rule r = {ACTION_ALLOW, MATCH_MCAST, 0, text};
+    std::string action = text.substr(0, colon);
+    std::string match = text.substr(colon + 1);
+
+    if (action == "allow") {
+      r.action = ACTION_ALLOW;
+    } else if (action == "drop") {
+      r.action = ACTION_DROP;
+    } else {
+      throw std::invalid_argument("invalid tap filter action: " + text);
+    }
+
+    if (match == "ipv6-mcast") {
+      r.match = MATCH_IPV6_MCAST;
+    } else if (match == "ipv4-mcast") {
+      r.match = MATCH_IPV4_MCAST;
+    } else if (match == "bcast") {
+      r.match = MATCH_BCAST;
+    } else if (match == "mcast") {
+      r.match = MATCH_MCAST;
+    } else if (match.compare(0, 10, "ethertype=") == 0) {
+      char *end;
+      unsigned long type = strtoul(match.c_str() + 10, &end, 0);
+      if (*end != '\0' || type > 0xffff) {
+        throw std::invalid_argument("invalid tap filter ethertype: " + text);
+      }
+      r.match = MATCH_ETHERTYPE;
+      r.ethertype = type;
+    } else {
+      throw std::invalid_argument("invalid tap filter match: " + text);
+    }
+
+    rules.push_back(r);
+  }
+  return rules;
+}
+
+tap_filter::tap_filter(const std::vector<rule> &rules)
+    : rules(rules), hits(new std::atomic<uint64_t>[rules.size()]),
+      map_fd(-1), prog_fd(-1), attached(false) {
+  for (size_t i = 0; i < rules.size(); i++) {
+    hits[i] = 0;
+  }
+}
+
+tap_filter::~tap_filter() {
+  if (prog_fd != -1) {
+    close(prog_fd);
+  }
+  if (map_fd != -1) {
+    close(map_fd);
+  }
+  delete[] hits;
+}
+
+/*
+ * instruction helpers, in the style of the kernel's filter.h
+ */
+static inline struct bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src,
+                                   int16_t off, int32_t imm) {
+  struct bpf_insn i;
+  memset(&i, 0, sizeof(i));
+  i.code = code;
+  i.dst_reg = dst;
+  i.src_reg = src;
+  i.off = off;
+  i.imm = imm;
+  return i;
+}
+
+static inline struct bpf_insn ld_abs(uint8_t size, int32_t off) {
+  return insn(BPF_LD | size | BPF_ABS, 0, 0, 0, off);
+}
+
+static inline struct bpf_insn jmp_imm(uint8_t op, uint8_t dst, int32_t imm,
+                                      int16_t off) {
+  return insn(BPF_JMP | op | BPF_K, dst, 0, off, imm);
+}
+
+static inline struct bpf_insn alu_imm(uint8_t op, uint8_t dst, int32_t imm) {
+  return insn(BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+}
+
+static inline struct bpf_insn mov_reg(uint8_t dst, uint8_t src) {
+  return insn(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+}
+
+static inline struct bpf_insn exit_insn() {
+  return insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+bool tap_filter::load() {
+  union bpf_attr attr;
+
+  if (map_fd == -1) {
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = rules.size();
+    map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0) {
+      LOG(WARNING) << __FUNCTION__ << ": bpf map: " << strerror(errno);
+      map_fd = -1;
+      return false;
+    }
+  }
+
+  // r6 holds the skb for the absolute loads, r0 the loaded value
+  std::vector<struct bpf_insn> prog;
+  prog.push_back(mov_reg(BPF_REG_6, BPF_REG_1));
+
+  // drop runts explicitly, as accept() does, and not by a load out of bounds
+  prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+                      offsetof(struct __sk_buff, len), 0));
+  prog.push_back(jmp_imm(BPF_JGE, BPF_REG_0, ETH_HLEN, 2));
+  prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0));
+  prog.push_back(exit_insn());
+
+  for (size_t i = 0; i < rules.size(); i++) {
+    const rule &r = rules[i];
+    std::vector<size_t> to_next; // jumps to the next rule
+
+    switch (r.match) {
+    case MATCH_IPV6_MCAST:
+      prog.push_back(ld_abs(BPF_H, 0));
+      to_next.push_back(prog.size());
+      prog.push_back(jmp_imm(BPF_JNE, BPF_REG_0, 0x3333, 0));
+      break;
+    case MATCH_IPV4_MCAST:
+      prog.push_back(ld_abs(BPF_W, 0));
+      prog.push_back(alu_imm(BPF_AND, BPF_REG_0, 0xffffff80));
+      to_next.push_back(prog.size());
+      prog.push_back(jmp_imm(BPF_JNE, BPF_REG_0, 0x01005e00, 0));
+      break;
+    case MATCH_BCAST:
+      // 16 bit at a time, a 32 bit immediate would be sign extended
+      for (int off = 0; off < ETH_ALEN; off += 2) {
+        prog.push_back(ld_abs(BPF_H, off));
+        to_next.push_back(prog.size());
+        prog.push_back(jmp_imm(BPF_JNE, BPF_REG_0, 0xffff, 0));
+      }
+      break;
+    case MATCH_MCAST:
+      prog.push_back(ld_abs(BPF_B, 0));
+      prog.push_back(alu_imm(BPF_AND, BPF_REG_0, 0x01));
+      to_next.push_back(prog.size());
+      prog.push_back(jmp_imm(BPF_JEQ, BPF_REG_0, 0, 0));
+      break;
+    case MATCH_ETHERTYPE:
+      // behind the tag only if the frame holds it, like accept()
+      prog.push_back(ld_abs(BPF_H, 12));
+      prog.push_back(jmp_imm(BPF_JNE, BPF_REG_0, ETH_P_8021Q, 3));
+      prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+                          offsetof(struct __sk_buff, len), 0));
+      prog.push_back(jmp_imm(BPF_JLT, BPF_REG_2, ETH_HLEN + 4, 1));
+      prog.push_back(ld_abs(BPF_H, 16));
+      to_next.push_back(prog.size());
+      prog.push_back(jmp_imm(BPF_JNE, BPF_REG_0, r.ethertype, 0));
+      break;
+    }
+
+    // hits[i]++
+    prog.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1,
+                        BPF_PSEUDO_MAP_FD, 0, map_fd));
+    prog.push_back(insn(0, 0, 0, 0, 0));
+    prog.push_back(insn(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, i));
+    prog.push_back(mov_reg(BPF_REG_2, BPF_REG_10));
+    prog.push_back(alu_imm(BPF_ADD, BPF_REG_2, -4));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+    prog.push_back(jmp_imm(BPF_JEQ, BPF_REG_0, 0, 2));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1));
+    prog.push_back(
+        insn(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0));
+
+    if (r.action == ACTION_DROP) {
+      prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0));
+    } else {
+      prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+                          offsetof(struct __sk_buff, len), 0));
+    }
+    prog.push_back(exit_insn());
+
+    for (auto j : to_next) {
+      prog[j].off = prog.size() - j - 1;
+    }
+  }
+
+  // no rule matched, keep the whole frame
+  prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+                      offsetof(struct __sk_buff, len), 0));
+  prog.push_back(exit_insn());
+
+  static const char license[] = "MPL-2.0";
+  std::vector<char> log(VLOG_IS_ON(1) ? 65536 : 0);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+  attr.insns = ptr_to_u64(prog.data());
+  attr.insn_cnt = prog.size();
+  attr.license = ptr_to_u64(license);
+  if (not log.empty()) {
+    attr.log_buf = ptr_to_u64(log.data());
+    attr.log_size = log.size();
+    attr.log_level = 1;
+  }
+
+  prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (prog_fd < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": bpf program: " << strerror(errno);
+    VLOG(1) << __FUNCTION__ << ": verifier log:" << std::endl
+            << (log.empty() ? "" : log.data());
+    prog_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+bool tap_filter::attach(int fd) {
+  if (rules.empty()) {
+    return true;
+  }
+
+  if (prog_fd == -1 && not load()) {
+    return false;
+  }
+
+  if (ioctl(fd, TUNSETFILTEREBPF, &prog_fd) < 0) {
+    LOG(WARNING) << __FUNCTION__ << ": TUNSETFILTEREBPF: " << strerror(errno);
+    close(prog_fd);
+    prog_fd = -1;
+    return false;
+  }
+  attached = true;
+  return true;
+}
+
+bool tap_filter::accept(const uint8_t *frame, size_t len) {
+  static const uint8_t bcast[ETH_ALEN] = {0xff, 0xff, 0xff,
+                                          0xff, 0xff, 0xff};
+
+  if (rules.empty()) {
+    return true;
+  }
+
+  // dropped by the kernel program as well
+  if (len < ETH_HLEN) {
+    return false;
+  }
+
+  uint16_t proto = (frame[12] << 8) | frame[13];
+  if (proto == ETH_P_8021Q && len >= ETH_HLEN + 4) {
+    proto = (frame[16] << 8) | frame[17];
+  }
+
+  for (size_t i = 0; i < rules.size(); i++) {
+    const rule &r = rules[i];
+    bool match = false;
+
+    switch (r.match) {
+    case MATCH_IPV6_MCAST:
+      match = frame[0] == 0x33 && frame[1] == 0x33;
+      break;
+    case MATCH_IPV4_MCAST:
+      match = frame[0] == 0x01 && frame[1] == 0x00 && frame[2] == 0x5e &&
+              not(frame[3] & 0x80);
+      break;
+    case MATCH_BCAST:
+      match = memcmp(frame, bcast, ETH_ALEN) == 0;
+      break;
+    case MATCH_MCAST:
+      match = frame[0] & 0x01;
+      break;
+    case MATCH_ETHERTYPE:
+      match = proto == r.ethertype;
+      break;
+    }
+
+    if (match) {
+      hits[i]++;
+      return r.action == ACTION_ALLOW;
+    }
+  }
+  return true;
+}
+
+uint64_t tap_filter::get_hits(size_t i) const {
+  uint64_t n = hits[i];
+
+  if (map_fd != -1) {
+    union bpf_attr attr;
+    uint32_t key = i;
+    uint64_t value = 0;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = ptr_to_u64(&key);
+    attr.value = ptr_to_u64(&value);
+    if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0) {
+      n += value;
+    }
+  }
+  return n;
+}
+
+} // namespace rofcore
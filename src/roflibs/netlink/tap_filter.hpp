@@ -0,0 +1,100 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace rofcore {
+
+/**
+ * drop and allow rules for the frames the host sends out of a tap device
+ *
+ * The rules are compiled into an eBPF socket filter, which the tap runs
+ * before it queues a frame for baseboxd (TUNSETFILTEREBPF). Every rule
+ * counts its hits in an array map. If the kernel refuses the program, the
+ * same rules are evaluated in userspace after the read. The first
+ * matching rule decides, frames matching no rule are allowed. Frames
+ * shorter than an Ethernet header are dropped, unless there are no rules.
+ */
+class tap_filter {
+public:
+  enum action {
+    ACTION_ALLOW,
+    ACTION_DROP,
+  };
+
+  enum match_type {
+    MATCH_IPV6_MCAST, ///< 33:33:xx:xx:xx:xx
+    MATCH_IPV4_MCAST, ///< 01:00:5e:0x:xx:xx
+    MATCH_BCAST,      ///< ff:ff:ff:ff:ff:ff
+    MATCH_MCAST,      ///< any group address
+    MATCH_ETHERTYPE,  ///< ethertype, behind a vlan tag as well
+  };
+
+  struct rule {
+    enum action action;
+    enum match_type match;
+    uint16_t ethertype;
+    std::string text;
+  };
+
+  /**
+   * parse comma separated rules "<allow|drop>:<match>", match is one of
+   * ipv6-mcast, ipv4-mcast, bcast, mcast or ethertype=<number>
+   *
+   * @throw std::invalid_argument
+   */
+  static std::vector<rule> parse(const std::string &spec);
+
+  tap_filter(const std::vector<rule> &rules);
+
+  ~tap_filter();
+
+  /**
+   * load the program and attach it to the tap device of fd
+   *
+   * @return false if the rules are evaluated in userspace
+   */
+  bool attach(int fd);
+
+  bool in_kernel() const { return attached; }
+
+  /**
+   * userspace evaluation
+   *
+   * @return true if the frame is allowed
+   */
+  bool accept(const uint8_t *frame, size_t len);
+
+  bool empty() const { return rules.empty(); }
+
+  friend std::ostream &operator<<(std::ostream &os, const tap_filter &f) {
+    for (size_t i = 0; i < f.rules.size(); i++) {
+      os << (i ? ", " : "") << f.rules[i].text << " " << f.get_hits(i);
+    }
+    return os;
+  }
+
+private:
+  tap_filter(const tap_filter &) = delete;
+  tap_filter &operator=(const tap_filter &) = delete;
+
+  bool load();
+
+  uint64_t get_hits(size_t i) const;
+
+  std::vector<rule> rules;
+  std::atomic<uint64_t> *hits; // of the userspace evaluation
+  int map_fd;
+  int prog_fd;
+  std::atomic<bool> attached; // read by the tap io workers
+};
+
+} // namespace rofcore
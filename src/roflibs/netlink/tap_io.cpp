@@ -0,0 +1,307 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_io.hpp"
+#include "roflibs/netlink/tap_uring.hpp"
+
+DEFINE_bool(tap_io_uring, false,
+            "Read and write the tap devices with io_uring, needs liburing "
+            "and Linux 6.7, frames must fit the default packet size");
+
+namespace rofcore {
+
+static const int MAX_EVENTS = 64;
+
+void tap_io_handler::handle_frame(packet *pkt) {
+  cpacketpool::get_instance().release_pkt(pkt);
+}
+
+void tap_io_handler::handle_write_done(tap_io_write &w, int res) {
+  cpacketpool::get_instance().release_pkt(w.pkt);
+}
+
+tap_io_worker::tap_io_worker(unsigned id)
+    : id(id), epfd(-1), evfd(-1), uring(nullptr), uring_more(false),
+      running(false) {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    throw std::runtime_error(std::string("epoll_create1: ") +
+                             strerror(errno));
+  }
+
+  evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (evfd < 0) {
+    ::close(epfd);
+    throw std::runtime_error(std::string("eventfd: ") + strerror(errno));
+  }
+
+  // the eventfd is the only fd without handler
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+
+  if (FLAGS_tap_io_uring) {
+#ifdef HAVE_LIBURING
+    try {
+      uring = new tap_uring();
+
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.ptr = uring;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, uring->get_eventfd(), &ev);
+    } catch (std::runtime_error &e) {
+      LOG(WARNING) << __FUNCTION__ << ": no io_uring, using epoll: "
+                   << e.what();
+    }
+#else
+    LOG(WARNING) << __FUNCTION__
+                 << ": built without liburing, using epoll for the taps";
+#endif
+  }
+}
+
+tap_io_worker::~tap_io_worker() {
+  stop();
+#ifdef HAVE_LIBURING
+  delete uring;
+#endif
+  ::close(evfd);
+  ::close(epfd);
+}
+
+void tap_io_worker::start() {
+  if (running.exchange(true)) {
+    return;
+  }
+  thread = std::thread(&tap_io_worker::run, this);
+
+  std::string name = "tap_io" + std::to_string(id);
+  pthread_setname_np(thread.native_handle(), name.c_str());
+}
+
+void tap_io_worker::stop() {
+  if (not running.exchange(false)) {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(evfd, &one, sizeof(one)) < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": eventfd write failed: " << strerror(errno);
+  }
+  thread.join();
+}
+
+bool tap_io_worker::add(tap_io_handler *h, int fd, bool try_uring) {
+  rofl::AcquireReadWriteLock rwlock(handlers_rwlock);
+
+#ifdef HAVE_LIBURING
+  if (uring && try_uring) {
+    handlers.insert(h);
+    uring->add(h, fd);
+    return true;
+  }
+#endif
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = h;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": epoll_ctl fd=" << fd
+               << " failed: " << strerror(errno);
+    return false;
+  }
+  handlers.insert(h);
+
+  // frames queued before the registration produce no edge
+  h->io_read_ready = true;
+  rx_ready.push_back(h);
+  notify_write(h);
+  return false;
+}
+
+void tap_io_worker::del(tap_io_handler *h, int fd) {
+  rofl::AcquireReadWriteLock rwlock(handlers_rwlock);
+
+#ifdef HAVE_LIBURING
+  if (uring) {
+    uring->del(h);
+  }
+#endif
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  handlers.erase(h);
+  rx_ready.erase(std::remove(rx_ready.begin(), rx_ready.end(), h),
+                 rx_ready.end());
+  h->io_read_ready = false;
+
+  rofl::AcquireReadWriteLock pending_lock(pending_rwlock);
+  pending.erase(std::remove(pending.begin(), pending.end(), h),
+                pending.end());
+  h->io_write_pending = false;
+}
+
+void tap_io_worker::notify_write(tap_io_handler *h) {
+  if (h->io_write_pending.exchange(true)) {
+    return;
+  }
+
+  bool wake;
+  {
+    rofl::AcquireReadWriteLock rwlock(pending_rwlock);
+    wake = pending.empty();
+    pending.push_back(h);
+  }
+
+  // the worker has not yet picked up the earlier posts otherwise
+  if (wake) {
+    uint64_t one = 1;
+    if (write(evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      LOG(ERROR) << __FUNCTION__
+                 << ": eventfd write failed: " << strerror(errno);
+    }
+  }
+}
+
+void tap_io_worker::submit_writes(tap_io_handler *h, int fd,
+                                  std::deque<tap_io_write> &writes) {
+#ifdef HAVE_LIBURING
+  if (uring) {
+    uring->write(h, fd, writes);
+    uring->submit();
+    return;
+  }
+#endif
+  // not reached, handlers use it only after add() returned true
+  for (auto &w : writes) {
+    h->handle_write_done(w, -EOPNOTSUPP);
+  }
+  writes.clear();
+}
+
+void tap_io_worker::handle_uring() {
+#ifdef HAVE_LIBURING
+  std::vector<std::pair<tap_io_handler *, int>> fallback;
+  uring_more = uring->poll(fallback);
+
+  for (auto &f : fallback) {
+    tap_io_handler *h = f.first;
+    int flags = fcntl(f.second, F_GETFL);
+    if (flags >= 0) {
+      fcntl(f.second, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = h;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, f.second, &ev) < 0) {
+      LOG(ERROR) << __FUNCTION__ << ": epoll_ctl fd=" << f.second
+                 << " failed: " << strerror(errno);
+      continue;
+    }
+    h->handle_uring_fallback();
+    if (not h->io_read_ready) {
+      h->io_read_ready = true;
+      rx_ready.push_back(h);
+    }
+  }
+#endif
+}
+
+void tap_io_worker::handle_wakeup() {
+  uint64_t cnt;
+  if (read(evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << __FUNCTION__ << ": eventfd read failed: " << strerror(errno);
+  }
+
+  std::vector<tap_io_handler *> writers;
+  {
+    rofl::AcquireReadWriteLock rwlock(pending_rwlock);
+    writers.swap(pending);
+  }
+
+  for (auto h : writers) {
+    h->io_write_pending = false;
+    h->handle_write();
+  }
+}
+
+void tap_io_worker::run() {
+  struct epoll_event events[MAX_EVENTS];
+  int timeout = -1;
+
+  while (running) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << __FUNCTION__ << ": epoll_wait failed: " << strerror(errno);
+      return;
+    }
+
+    rofl::AcquireReadWriteLock rwlock(handlers_rwlock);
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == nullptr) {
+        handle_wakeup();
+        continue;
+      }
+      if (events[i].data.ptr == uring) {
+        handle_uring();
+        continue;
+      }
+
+      tap_io_handler *h = static_cast<tap_io_handler *>(events[i].data.ptr);
+
+      // deleted after epoll_wait returned
+      if (handlers.find(h) == handlers.end()) {
+        continue;
+      }
+
+      if (events[i].events & (EPOLLOUT | EPOLLERR)) {
+        h->handle_write();
+      }
+      if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+          not h->io_read_ready) {
+        h->io_read_ready = true;
+        rx_ready.push_back(h);
+      }
+    }
+
+    // one read budget per queue and round
+    for (size_t i = rx_ready.size(); i > 0; i--) {
+      tap_io_handler *h = rx_ready.front();
+      rx_ready.pop_front();
+      if (h->handle_read()) {
+        rx_ready.push_back(h);
+      } else {
+        h->io_read_ready = false;
+      }
+    }
+
+    // completions left over produce no new edge
+    if (uring_more) {
+      handle_uring();
+    }
+
+    // do not block while queues are left over from this round
+    timeout = rx_ready.empty() && not uring_more ? -1 : 0;
+  }
+}
+
+} // namespace rofcore
@@ -0,0 +1,153 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <rofl/common/locking.hpp>
+
+#include "roflibs/netlink/packet.hpp"
+
+namespace rofcore {
+
+class tap_io_worker;
+class tap_uring;
+
+/**
+ * frame written through the io_uring of a tap_io_worker
+ */
+struct tap_io_write {
+  packet *pkt;
+  unsigned tag; // defined by the handler
+  std::chrono::steady_clock::time_point queued;
+};
+
+/**
+ * file descriptor served by a tap_io_worker
+ */
+class tap_io_handler {
+public:
+  tap_io_handler() : io_write_pending(false), io_read_ready(false) {}
+
+  virtual ~tap_io_handler() {}
+
+  /**
+   * read from the edge triggered fd
+   *
+   * @return true if the read budget was used up before the fd was drained
+   */
+  virtual bool handle_read() = 0;
+
+  virtual void handle_write() = 0;
+
+  /**
+   * frame read by the io_uring of the worker, the handler owns pkt
+   */
+  virtual void handle_frame(packet *pkt);
+
+  /**
+   * end of a batch of handle_frame() calls
+   */
+  virtual void handle_frames_done() {}
+
+  /**
+   * write submitted with tap_io_worker::submit_writes() completed, the
+   * handler owns w.pkt
+   *
+   * @param res bytes written, or a negative errno
+   */
+  virtual void handle_write_done(tap_io_write &w, int res);
+
+  /**
+   * the fd was moved from the io_uring to epoll, it is non-blocking again
+   */
+  virtual void handle_uring_fallback() {}
+
+private:
+  friend class tap_io_worker;
+
+  std::atomic<bool> io_write_pending; // queued in tap_io_worker::pending
+  bool io_read_ready;                 // queued in tap_io_worker::rx_ready
+};
+
+/**
+ * I/O thread multiplexing the queues of many tap devices
+ *
+ * The fds are registered edge triggered. Queues that still have frames
+ * after their read budget are served round robin with the other ready
+ * queues. Writers post a queue with notify_write(), a burst of posts
+ * wakes the thread once through an eventfd.
+ *
+ * With --tap_io_uring, fds are served by an io_uring of the worker
+ * instead, if the kernel and the build support it.
+ */
+class tap_io_worker {
+public:
+  tap_io_worker(unsigned id);
+
+  ~tap_io_worker();
+
+  void start();
+
+  void stop();
+
+  /**
+   * @param try_uring read and write fd with the io_uring of the worker
+   * @return true if fd is served by the io_uring
+   */
+  bool add(tap_io_handler *h, int fd, bool try_uring = false);
+
+  /**
+   * unregister h, after the return no callback of h is running or due
+   */
+  void del(tap_io_handler *h, int fd);
+
+  /**
+   * call handle_write() of h from the worker thread
+   */
+  void notify_write(tap_io_handler *h);
+
+  /**
+   * write the frames to fd through the io_uring, only from a callback of
+   * h, every write completes with h->handle_write_done()
+   */
+  void submit_writes(tap_io_handler *h, int fd,
+                     std::deque<tap_io_write> &writes);
+
+  unsigned get_id() const { return id; }
+
+private:
+  tap_io_worker(const tap_io_worker &) = delete;
+  tap_io_worker &operator=(const tap_io_worker &) = delete;
+
+  void run();
+
+  void handle_wakeup();
+
+  void handle_uring();
+
+  unsigned id;
+  int epfd;
+  int evfd;
+  tap_uring *uring;  // NULL without io_uring
+  bool uring_more;   // completions left over from the last round
+  std::atomic<bool> running;
+  std::thread thread;
+
+  // held by the worker while dispatching
+  rofl::crwlock handlers_rwlock;
+  std::set<tap_io_handler *> handlers;
+  std::deque<tap_io_handler *> rx_ready;
+
+  rofl::crwlock pending_rwlock;
+  std::vector<tap_io_handler *> pending;
+};
+
+} // namespace rofcore
@@ -2,17 +2,105 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
 #include "roflibs/netlink/tap_manager.hpp"
 #include "roflibs/netlink/cnetlink.hpp"
 
+DEFINE_int32(tap_queues, 1,
+             "Number of queues per tap device, more than one enables "
+             "IFF_MULTI_QUEUE");
+DEFINE_int32(tap_io_threads, 2,
+             "Number of threads serving the queues of all tap devices");
+DEFINE_int32(tap_open_threads, 8,
+             "Number of threads opening and closing the tap devices");
+DEFINE_string(tap_filter, "drop:ipv6-mcast",
+              "Comma separated <allow|drop>:<match> rules for the frames "
+              "read from the tap devices, match is one of ipv6-mcast, "
+              "ipv4-mcast, bcast, mcast or ethertype=<number>");
+DEFINE_string(tap_filter_port, "",
+              "Semicolon separated <port>=<rules>, evaluated before "
+              "--tap_filter on the tap device of the port");
+
 namespace rofcore {
 
-tap_manager::~tap_manager() { destroy_tapdevs(); }
+tap_manager::tap_manager() : next_worker(0) {
+  for (int i = 0; i < std::max(FLAGS_tap_io_threads, 1); i++) {
+    workers.push_back(new tap_io_worker(i));
+  }
+
+  try {
+    filter_rules = tap_filter::parse(FLAGS_tap_filter);
+
+    std::istringstream ss(FLAGS_tap_filter_port);
+    std::string port;
+    while (std::getline(ss, port, ';')) {
+      size_t eq = port.find('=');
+      if (eq == std::string::npos) {
+        throw std::invalid_argument("tap filter without port: " + port);
+      }
+      port_filter_rules[port.substr(0, eq)] =
+          tap_filter::parse(port.substr(eq + 1));
+    }
+  } catch (std::invalid_argument &e) {
+    LOG(FATAL) << __FUNCTION__ << ": " << e.what();
+  }
+  cnetlink::get_instance().set_tap_manager(this);
+}
+
+tap_manager::~tap_manager() {
+  cnetlink::get_instance().set_tap_manager(nullptr);
+  destroy_tapdevs();
+  for (auto w : workers) {
+    delete w;
+  }
+}
 
 void tap_manager::start() {
+  auto t0 = std::chrono::steady_clock::now();
+
+  for (auto w : workers) {
+    w->start();
+  }
+
+  for_each_dev(devs, [](ctapdev *dev) { dev->tap_open(); });
+  auto t1 = std::chrono::steady_clock::now();
+
+  // the link events of all new devices are applied in one go
   cnetlink::get_instance().start();
-  for (auto dev : devs) {
-    dev->tap_open();
+
+  LOG(INFO) << __FUNCTION__ << ": opened " << devs.size() << " tap devices in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0)
+                   .count()
+            << "ms";
+}
+
+void tap_manager::for_each_dev(const std::vector<ctapdev *> &devs,
+                               std::function<void(ctapdev *)> f) {
+  std::atomic<size_t> next(0);
+  auto run = [&devs, &next, &f]() {
+    for (size_t i = next++; i < devs.size(); i = next++) {
+      f(devs[i]);
+    }
+  };
+
+  size_t n_threads = std::min<size_t>(std::max(FLAGS_tap_open_threads, 1),
+                                      devs.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; i++) {
+    threads.push_back(std::thread(run));
+  }
+  run();
+  for (auto &t : threads) {
+    t.join();
   }
 }
 
@@ -36,6 +124,8 @@ tap_manager::register_tapdevs(std::deque<std::string> &port_names,
     }
   }
 
+  // handed over at once, before any of the devices exists
+  cnetlink::get_instance().register_links(r);
   return r;
 }
 
@@ -45,24 +135,60 @@ int tap_manager::create_tapdev(const std::string &port_name, tap_callback &cb) {
   if (it != devname_to_spot.end()) {
     r = it->second;
   } else {
+    // spread the queues of all devices over the workers
+    std::vector<tap_io_worker *> queue_workers;
+    for (int i = 0; i < std::max(FLAGS_tap_queues, 1); i++) {
+      queue_workers.push_back(workers[next_worker++ % workers.size()]);
+    }
+
     ctapdev *dev;
     try {
-      dev = new ctapdev(cb, port_name);
+      dev = new ctapdev(cb, port_name, queue_workers);
     } catch (std::exception &e) {
       // TODO log error
       return -EINVAL;
     }
+
+    std::vector<tap_filter::rule> rules;
+    auto pf = port_filter_rules.find(port_name);
+    if (pf != port_filter_rules.end()) {
+      rules = pf->second;
+    }
+    rules.insert(rules.end(), filter_rules.begin(), filter_rules.end());
+    dev->set_filter(new tap_filter(rules));
+
     r = devs.size();
     devs.push_back(dev);
-
-    cnetlink::get_instance().register_link(r, port_name);
     devname_to_spot.insert(std::make_pair(port_name, r));
   }
   return r;
 }
 
+void tap_manager::set_mtu(int i, unsigned mtu) {
+  if (0 <= i && (size_t)i < devs.size()) {
+    devs[i]->set_mtu(mtu);
+  }
+}
+
+void tap_manager::clear_port_nos() {
+  for (auto dev : devs) {
+    dev->set_port_no(0);
+  }
+}
+
+void tap_manager::clear_port_no(const std::string &devname) {
+  auto it = devname_to_spot.find(devname);
+  if (it != devname_to_spot.end()) {
+    devs[it->second]->set_port_no(0);
+  }
+}
+
 void tap_manager::destroy_tapdevs() {
   std::vector<ctapdev *> ddevs = std::move(devs);
+
+  // the kernel waits for an RCU grace period per removed device, closing
+  // them in parallel overlaps the waits
+  for_each_dev(ddevs, [](ctapdev *dev) { dev->tap_close(); });
   for (auto &dev : ddevs) {
     delete dev;
   }
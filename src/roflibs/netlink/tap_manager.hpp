@@ -5,26 +5,35 @@
 #pragma once
 
 #include <deque>
+#include <functional>
+#include <ostream>
 #include <string>
 #include <vector>
 #include <map>
 
-#include <rofl/common/cpacket.h>
-
 #include "roflibs/netlink/ctapdev.hpp"
+#include "roflibs/netlink/packet.hpp"
+#include "roflibs/netlink/tap_filter.hpp"
+#include "roflibs/netlink/tap_io.hpp"
 
 namespace rofcore {
 
 class tap_callback {
 public:
   virtual ~tap_callback(){};
-  virtual int enqueue(rofcore::ctapdev *, rofl::cpacket *) = 0;
+
+  /**
+   * hand over a burst of frames read from a tap device
+   *
+   * The callee takes ownership of the packets and clears pkts.
+   */
+  virtual int enqueue(rofcore::ctapdev *, std::vector<rofcore::packet *> &) = 0;
 };
 
 class tap_manager final {
 
 public:
-  tap_manager(){};
+  tap_manager();
   ~tap_manager();
 
   /**
@@ -43,14 +52,41 @@ public:
 
   ctapdev &get_dev(int i) { return *devs[i]; }
 
+  void set_mtu(int i, unsigned mtu);
+
+  /**
+   * forget the cached OpenFlow port numbers, of all devices or of the
+   * device named devname
+   */
+  void clear_port_nos();
+
+  void clear_port_no(const std::string &devname);
+
+  friend std::ostream &operator<<(std::ostream &os, const tap_manager &tm) {
+    for (auto dev : tm.devs) {
+      os << *dev << std::endl;
+    }
+    return os;
+  }
+
 private:
   tap_manager(const tap_manager &other) = delete; // non construction-copyable
   tap_manager &operator=(const tap_manager &) = delete; // non copyable
 
   int create_tapdev(const std::string &, tap_callback &);
 
+  /**
+   * call f for every device, from up to --tap_open_threads threads
+   */
+  static void for_each_dev(const std::vector<ctapdev *> &devs,
+                           std::function<void(ctapdev *)> f);
+
   std::vector<ctapdev *> devs;
   std::map<std::string, int> devname_to_spot;
+  std::vector<tap_io_worker *> workers;
+  unsigned next_worker;
+  std::vector<tap_filter::rule> filter_rules;
+  std::map<std::string, std::vector<tap_filter::rule>> port_filter_rules;
 };
 
 } // namespace rofcore
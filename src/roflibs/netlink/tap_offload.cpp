@@ -0,0 +1,202 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_offload.hpp"
+
+namespace rofcore {
+
+static const size_t IPV4_MIN_HLEN = 20;
+static const size_t IPV6_HLEN = 40;
+static const size_t TCP_MIN_HLEN = 20;
+static const size_t UDP_CSUM_OFFSET = 6;
+
+/*
+ * ones' complement sum in memory order, folded by csum_fold. The words
+ * are loaded with memcpy, so the frames need no alignment.
+ */
+static inline uint64_t csum_partial(const uint8_t *p, size_t len,
+                                    uint64_t sum) {
+  uint32_t w32;
+  uint16_t w16;
+
+  for (; len >= 4; p += 4, len -= 4) {
+    memcpy(&w32, p, 4);
+    sum += w32;
+  }
+  if (len >= 2) {
+    memcpy(&w16, p, 2);
+    sum += w16;
+    p += 2;
+    len -= 2;
+  }
+  if (len) {
+    uint8_t tail[2] = {p[0], 0};
+    memcpy(&w16, tail, 2);
+    sum += w16;
+  }
+  return sum;
+}
+
+/*
+ * csum_partial of src while copying it to dst
+ */
+static inline uint64_t csum_copy(uint8_t *dst, const uint8_t *src, size_t len,
+                                 uint64_t sum) {
+  uint32_t w32;
+  uint16_t w16;
+
+  for (; len >= 4; src += 4, dst += 4, len -= 4) {
+    memcpy(&w32, src, 4);
+    memcpy(dst, &w32, 4);
+    sum += w32;
+  }
+  if (len >= 2) {
+    memcpy(&w16, src, 2);
+    memcpy(dst, &w16, 2);
+    sum += w16;
+    src += 2;
+    dst += 2;
+    len -= 2;
+  }
+  if (len) {
+    uint8_t tail[2] = {src[0], 0};
+    dst[0] = src[0];
+    memcpy(&w16, tail, 2);
+    sum += w16;
+  }
+  return sum;
+}
+
+static inline uint16_t csum_fold(uint64_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum & 0xffff;
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+  v = htons(v);
+  memcpy(p, &v, 2);
+}
+
+bool tap_csum_complete(uint8_t *frame, size_t len, const vnet_hdr &hdr) {
+  size_t start = hdr.csum_start;
+  size_t field = start + hdr.csum_offset;
+
+  if (field + 2 > len) {
+    return false;
+  }
+
+  // the field holds the pseudo header sum already
+  uint16_t csum = csum_fold(csum_partial(frame + start, len - start, 0));
+  if (csum == 0 && hdr.csum_offset == UDP_CSUM_OFFSET) {
+    csum = 0xffff; // 0 means no checksum for udp
+  }
+  memcpy(frame + field, &csum, 2);
+  return true;
+}
+
+size_t tap_gso_segment(const uint8_t *frame, size_t len, const vnet_hdr &hdr,
+                       std::vector<packet *> &out) {
+  uint8_t gso_type = hdr.gso_type & ~vnet_hdr::GSO_ECN;
+  bool v4 = gso_type == vnet_hdr::GSO_TCPV4;
+
+  if ((not v4 && gso_type != vnet_hdr::GSO_TCPV6) ||
+      not(hdr.flags & vnet_hdr::F_NEEDS_CSUM) || len < ETH_HLEN) {
+    return 0;
+  }
+
+  size_t l3 = ETH_HLEN;
+  if (((frame[12] << 8) | frame[13]) == ETH_P_8021Q) {
+    l3 += 4;
+  }
+
+  size_t l4 = hdr.csum_start;
+  if (l4 < l3 + (v4 ? IPV4_MIN_HLEN : IPV6_HLEN) ||
+      l4 + TCP_MIN_HLEN > len) {
+    return 0;
+  }
+
+  size_t thl = (frame[l4 + 12] >> 4) * 4;
+  size_t hlen = l4 + thl;
+  size_t mss = hdr.gso_size;
+  if (thl < TCP_MIN_HLEN || hlen >= len || mss == 0) {
+    return 0;
+  }
+
+  uint32_t seq;
+  memcpy(&seq, frame + l4 + 4, 4);
+  seq = ntohl(seq);
+
+  uint16_t id = 0;
+  if (v4) {
+    id = (frame[l3 + 4] << 8) | frame[l3 + 5];
+  }
+
+  // addresses and protocol of the pseudo header are the same for all
+  uint64_t pseudo = v4 ? csum_partial(frame + l3 + 12, 8, 0)
+                       : csum_partial(frame + l3 + 8, 32, 0);
+  pseudo += htons(IPPROTO_TCP);
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  size_t n = 0;
+  for (size_t off = hlen; off < len; off += mss, n++) {
+    size_t plen = std::min(mss, len - off);
+    bool first = off == hlen;
+    bool last = off + plen == len;
+
+    packet *pkt = pool.acquire_pkt(hlen + plen);
+    if (pkt == NULL) {
+      LOG(ERROR) << __FUNCTION__ << ": no packet after " << n << " segments";
+      break;
+    }
+
+    uint8_t *p = pkt->data();
+    memcpy(p, frame, hlen);
+
+    if (v4) {
+      put16(p + l3 + 2, hlen - l3 + plen); // tot_len
+      put16(p + l3 + 4, id + n);
+      p[l3 + 10] = p[l3 + 11] = 0;
+      uint16_t csum = csum_fold(csum_partial(p + l3, l4 - l3, 0));
+      memcpy(p + l3 + 10, &csum, 2);
+    } else {
+      put16(p + l3 + 4, hlen - l3 - IPV6_HLEN + plen); // payload_len
+    }
+
+    uint32_t s = htonl(seq + (off - hlen));
+    memcpy(p + l4 + 4, &s, 4);
+    if (not last) {
+      p[l4 + 13] &= ~(TH_FIN | TH_PUSH);
+    }
+    if (not first) {
+      p[l4 + 13] &= ~0x80; // CWR
+    }
+    p[l4 + 16] = p[l4 + 17] = 0;
+
+    uint64_t sum = pseudo + htons(thl + plen);
+    sum = csum_partial(p + l4, thl, sum);
+    sum = csum_copy(p + hlen, frame + off, plen, sum);
+    uint16_t csum = csum_fold(sum);
+    memcpy(p + l4 + 16, &csum, 2);
+
+    pkt->set_length(hlen + plen);
+    out.push_back(pkt);
+  }
+
+  return n;
+}
+
+} // namespace rofcore
@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "roflibs/netlink/packet.hpp"
+
+namespace rofcore {
+
+/**
+ * struct virtio_net_hdr in host byte order, linux/virtio_net.h does not
+ * compile as C++
+ */
+struct vnet_hdr {
+  enum {
+    F_NEEDS_CSUM = 1,
+  };
+
+  enum {
+    GSO_NONE = 0,
+    GSO_TCPV4 = 1,
+    GSO_UDP = 3,
+    GSO_TCPV6 = 4,
+    GSO_ECN = 0x80,
+  };
+
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} __attribute__((packed));
+
+// largest GSO frame handed over by a tap device with IFF_VNET_HDR
+static const size_t TAP_GSO_MAX_FRAME = 65536 + 18;
+
+/**
+ * fill in a checksum the kernel left partial (vnet_hdr::F_NEEDS_CSUM)
+ *
+ * @return false if the offsets in hdr are outside of the frame
+ */
+bool tap_csum_complete(uint8_t *frame, size_t len, const vnet_hdr &hdr);
+
+/**
+ * split a TCP GSO frame into frames of at most gso_size payload
+ *
+ * Every segment is written to a packet of the cpacketpool and appended to
+ * out. Headers and payload are copied and checksummed in one pass.
+ *
+ * @return number of segments, 0 if the frame is not a TCP GSO frame
+ */
+size_t tap_gso_segment(const uint8_t *frame, size_t len, const vnet_hdr &hdr,
+                       std::vector<packet *> &out);
+
+} // namespace rofcore
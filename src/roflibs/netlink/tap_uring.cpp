@@ -0,0 +1,284 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifdef HAVE_LIBURING
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include <glog/logging.h>
+
+#include "roflibs/netlink/cpacketpool.hpp"
+#include "roflibs/netlink/tap_io.hpp"
+#include "roflibs/netlink/tap_uring.hpp"
+
+namespace rofcore {
+
+static const int BUF_GROUP = 0;
+static const unsigned CQE_BUDGET = 256;
+
+// user data of reads carry the handler, writes their slot and cancels are 0
+static const uint64_t TAG_READ = 1;
+static const uint64_t TAG_WRITE = 2;
+static const uint64_t TAG_CANCEL = 0;
+static const unsigned TAG_BITS = 2;
+
+// configure rejects these headers, the ring tail would overlap buffer 0
+static_assert(offsetof(struct io_uring_buf_ring, bufs) == 0,
+              "io_uring_buf_ring::bufs misplaced by the kernel headers");
+
+tap_uring::tap_uring() : br(nullptr), evfd(-1) {
+  int rc = io_uring_queue_init(SQ_ENTRIES, &ring, 0);
+  if (rc < 0) {
+    throw std::runtime_error(std::string("io_uring_queue_init: ") +
+                             strerror(-rc));
+  }
+
+  br = io_uring_setup_buf_ring(&ring, BUF_ENTRIES, BUF_GROUP, 0, &rc);
+  if (br == nullptr) {
+    teardown();
+    throw std::runtime_error(std::string("io_uring_setup_buf_ring: ") +
+                             strerror(-rc));
+  }
+
+  evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (evfd < 0 || io_uring_register_eventfd(&ring, evfd) < 0) {
+    teardown();
+    throw std::runtime_error("io_uring eventfd registration failed");
+  }
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  for (unsigned i = 0; i < BUF_ENTRIES; i++) {
+    packet *pkt = pool.acquire_pkt();
+    if (pkt == nullptr) {
+      teardown();
+      throw std::runtime_error("no packets for the io_uring buffer ring");
+    }
+    bufs.push_back(pkt);
+    provide(i);
+  }
+}
+
+tap_uring::~tap_uring() { teardown(); }
+
+void tap_uring::teardown() {
+  // pending operations are cancelled by the exit
+  if (br) {
+    io_uring_free_buf_ring(&ring, br, BUF_ENTRIES, BUF_GROUP);
+  }
+  io_uring_queue_exit(&ring);
+  if (evfd >= 0) {
+    ::close(evfd);
+  }
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  for (auto pkt : bufs) {
+    pool.release_pkt(pkt);
+  }
+  for (auto &slot : writes) {
+    if (slot.w.pkt) {
+      pool.release_pkt(slot.w.pkt);
+    }
+  }
+}
+
+void tap_uring::provide(unsigned short bid) {
+  packet *pkt = bufs[bid];
+  pkt->reset();
+  io_uring_buf_ring_add(br, pkt->data(), pkt->capacity(), bid,
+                        io_uring_buf_ring_mask(BUF_ENTRIES), 0);
+  io_uring_buf_ring_advance(br, 1);
+}
+
+struct io_uring_sqe *tap_uring::get_sqe() {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (sqe == nullptr) {
+    // the submission queue is full, make room
+    io_uring_submit(&ring);
+    sqe = io_uring_get_sqe(&ring);
+  }
+  return sqe;
+}
+
+void tap_uring::arm(tap_io_handler *h, int fd) {
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe == nullptr) {
+    LOG(ERROR) << __FUNCTION__ << ": no sqe to arm the read of fd=" << fd;
+    return;
+  }
+  io_uring_prep_read_multishot(sqe, fd, 0, 0, BUF_GROUP);
+  io_uring_sqe_set_data64(sqe, reinterpret_cast<uint64_t>(h) | TAG_READ);
+}
+
+void tap_uring::add(tap_io_handler *h, int fd) {
+  // the ring waits for data itself
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0) {
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  }
+
+  readers[h] = fd;
+  arm(h, fd);
+  submit();
+}
+
+void tap_uring::del(tap_io_handler *h) {
+  // its writes in flight complete without it
+  for (auto &slot : writes) {
+    if (slot.h == h) {
+      slot.h = nullptr;
+    }
+  }
+
+  if (readers.erase(h) == 0) {
+    return;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe) {
+    io_uring_prep_cancel64(sqe, reinterpret_cast<uint64_t>(h) | TAG_READ,
+                           IORING_ASYNC_CANCEL_ALL);
+    io_uring_sqe_set_data64(sqe, TAG_CANCEL);
+    submit();
+  }
+}
+
+void tap_uring::write(tap_io_handler *h, int fd,
+                      std::deque<tap_io_write> &ws) {
+  for (auto &w : ws) {
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == nullptr) {
+      h->handle_write_done(w, -EBUSY);
+      continue;
+    }
+
+    unsigned idx;
+    if (free_writes.empty()) {
+      idx = writes.size();
+      writes.push_back(write_slot());
+    } else {
+      idx = free_writes.back();
+      free_writes.pop_back();
+    }
+    writes[idx].h = h;
+    writes[idx].w = w;
+
+    io_uring_prep_write(sqe, fd, w.pkt->data(), w.pkt->length(), 0);
+    io_uring_sqe_set_data64(sqe, ((uint64_t)idx << TAG_BITS) | TAG_WRITE);
+  }
+  ws.clear();
+}
+
+void tap_uring::submit() {
+  int rc = io_uring_submit(&ring);
+  if (rc < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": io_uring_submit failed: "
+               << strerror(-rc);
+  }
+}
+
+bool tap_uring::poll(std::vector<std::pair<tap_io_handler *, int>> &fallback) {
+  uint64_t cnt;
+  if (read(evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+    LOG(ERROR) << __FUNCTION__ << ": eventfd read failed: " << strerror(errno);
+  }
+
+  cpacketpool &pool = cpacketpool::get_instance();
+  struct io_uring_cqe *cqes[CQE_BUDGET];
+  unsigned n = io_uring_peek_batch_cqe(&ring, cqes, CQE_BUDGET);
+  std::set<tap_io_handler *> readers_done;
+
+  for (unsigned i = 0; i < n; i++) {
+    struct io_uring_cqe *cqe = cqes[i];
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+
+    if (data == TAG_CANCEL) {
+      // the read ends with its own ECANCELED completion
+      continue;
+    }
+
+    if (data & TAG_WRITE) {
+      unsigned idx = data >> TAG_BITS;
+      write_slot slot = writes[idx];
+      writes[idx].w.pkt = nullptr;
+      free_writes.push_back(idx);
+
+      if (cqe->res < 0 && cqe->res != -EIO) {
+        // EIO: the tap is down
+        LOG(ERROR) << __FUNCTION__ << ": write failed: " << strerror(-cqe->res);
+      }
+      if (slot.h) {
+        slot.h->handle_write_done(slot.w, cqe->res);
+      } else {
+        pool.release_pkt(slot.w.pkt);
+      }
+      continue;
+    }
+
+    tap_io_handler *h = reinterpret_cast<tap_io_handler *>(data & ~TAG_READ);
+    auto it = readers.find(h);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      packet *pkt = bufs[bid];
+
+      if (it != readers.end() && cqe->res > 0) {
+        // the buffer goes to the handler, a fresh one takes its place
+        packet *fresh = pool.acquire_pkt();
+        if (fresh) {
+          pkt->set_length(cqe->res);
+          bufs[bid] = fresh;
+          h->handle_frame(pkt);
+          readers_done.insert(h);
+        } else {
+          VLOG(1) << __FUNCTION__ << ": packet pool exhausted, frame dropped";
+        }
+      }
+      provide(bid);
+    }
+
+    if (it == readers.end() || (cqe->flags & IORING_CQE_F_MORE)) {
+      continue;
+    }
+
+    // the multishot read ended
+    switch (-cqe->res) {
+    case EINVAL:
+    case EOPNOTSUPP:
+      // kernels before 6.7
+      fallback.push_back(*it);
+      readers.erase(it);
+      break;
+    case ECANCELED:
+      break;
+    default:
+      if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        LOG(ERROR) << __FUNCTION__ << ": read failed: " << strerror(-cqe->res);
+      }
+      arm(h, it->second);
+      break;
+    }
+  }
+  io_uring_cq_advance(&ring, n);
+
+  for (auto h : readers_done) {
+    h->handle_frames_done();
+  }
+
+  // rearmed reads
+  submit();
+  return n == CQE_BUDGET;
+}
+
+} // namespace rofcore
+
+#endif // HAVE_LIBURING
@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#ifdef HAVE_LIBURING
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <liburing.h>
+
+#include "roflibs/netlink/packet.hpp"
+#include "roflibs/netlink/tap_io.hpp"
+
+namespace rofcore {
+
+/**
+ * io_uring of a tap_io_worker
+ *
+ * Every registered fd has a multishot read armed, which picks its buffers
+ * from a ring of packets of the cpacketpool. Writes are queued and
+ * submitted once per batch. Completions are signalled on an eventfd,
+ * which the worker polls with its other fds. Only the worker thread, or a
+ * thread holding the worker lock, may call into the ring.
+ */
+class tap_uring {
+public:
+  static const unsigned SQ_ENTRIES = 256;
+  static const unsigned BUF_ENTRIES = 256;
+
+  /**
+   * @throw std::runtime_error if the kernel lacks io_uring or buffer rings
+   */
+  tap_uring();
+
+  ~tap_uring();
+
+  int get_eventfd() const { return evfd; }
+
+  /**
+   * arm a multishot read on fd, frames are passed to h->handle_frame()
+   */
+  void add(tap_io_handler *h, int fd);
+
+  void del(tap_io_handler *h);
+
+  /**
+   * queue a write of every frame in writes, each completes with
+   * h->handle_write_done()
+   */
+  void write(tap_io_handler *h, int fd, std::deque<tap_io_write> &writes);
+
+  void submit();
+
+  /**
+   * harvest completions
+   *
+   * @param fallback handlers whose fd does not support multishot reads,
+   * they are unregistered
+   * @return true if completions are left after the budget
+   */
+  bool poll(std::vector<std::pair<tap_io_handler *, int>> &fallback);
+
+private:
+  tap_uring(const tap_uring &) = delete;
+  tap_uring &operator=(const tap_uring &) = delete;
+
+  void teardown();
+
+  struct io_uring_sqe *get_sqe();
+
+  void arm(tap_io_handler *h, int fd);
+
+  void provide(unsigned short bid);
+
+  struct write_slot {
+    tap_io_handler *h; // NULL once h was deleted
+    tap_io_write w;
+  };
+
+  struct io_uring ring;
+  struct io_uring_buf_ring *br;
+  std::vector<packet *> bufs; // indexed by buffer id
+  int evfd;
+  std::map<tap_io_handler *, int> readers;
+  std::vector<write_slot> writes; // writes in flight, by user data
+  std::vector<unsigned> free_writes;
+};
+
+} // namespace rofcore
+
+#endif // HAVE_LIBURING
@@ -2,17 +2,52 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <sstream>
 #include <linux/if_ether.h>
 
+#include <gflags/gflags.h>
+
 #include "cbasebox.hpp"
 
 #include "roflibs/netlink/cpacketpool.hpp"
 #include "roflibs/of-dpa/ofdpa_datatypes.hpp"
 
+DEFINE_int32(stats_interval, 60,
+             "Interval in seconds to log statistics, 0 to disable");
+DEFINE_int32(pktout_batch_size, 64,
+             "Maximum number of packet-outs sent per batch");
+DEFINE_int32(table_reserve_percent, 10,
+             "Percentage of each switch table reserved for static entries");
+
+static bool validate_percent(const char *flagname, gflags::int32 value) {
+  return value >= 0 && value <= 100;
+}
+static const bool table_reserve_percent_valid = gflags::RegisterFlagValidator(
+    &FLAGS_table_reserve_percent, &validate_percent);
+DEFINE_int32(pktin_miss_send_len, 128,
+             "Bytes of a frame sent in packet-ins without a controller "
+             "output action (source MAC learning), 65535 for all");
+DEFINE_int32(checkpoint_settle_time, 15,
+             "Seconds after a warm start until restored entries that "
+             "netlink did not confirm are removed from the switch");
+DEFINE_int32(checkpoint_restore_timeout, 10,
+             "Seconds to wait for the bridging entries of the switch on a "
+             "warm start, before starting cold");
+
 namespace basebox {
 
+// offset of table_id in struct ofp_flow_mod, i.e. in the error data
+static const size_t FLOW_MOD_TABLE_ID_OFFSET = 24;
+
+static bool port_is_up(const rofl::openflow::cofport &port) {
+  return not(port.get_state() & rofl::openflow13::OFPPS_LINK_DOWN) &&
+         not(port.get_config() & rofl::openflow13::OFPPC_PORT_DOWN);
+}
+
 struct vlan_hdr {
   struct ethhdr eth; // vid + cfi + pcp
   uint16_t vlan;     // ethernet type
@@ -20,6 +55,23 @@ struct vlan_hdr {
 
 /*static*/ bool cbasebox::keep_on_running = true;
 
+cbasebox::fdb_key::fdb_key(uint32_t port, uint16_t vid,
+                           const rofl::cmacaddr &mac)
+    : port(port), vid(vid), mac(0) {
+  const uint8_t *a = mac.somem();
+  for (size_t i = 0; i < mac.memlen() && i < sizeof(this->mac); i++) {
+    this->mac = (this->mac << 8) | a[i];
+  }
+}
+
+rofl::cmacaddr cbasebox::fdb_key::get_mac() const {
+  uint8_t a[ETH_ALEN];
+  for (int i = ETH_ALEN - 1; i >= 0; i--) {
+    a[i] = (mac >> (8 * (ETH_ALEN - 1 - i))) & 0xff;
+  }
+  return rofl::cmacaddr(a, ETH_ALEN);
+}
+
 void cbasebox::handle_dpt_open(rofl::crofdpt &dpt) {
 
   if (rofl::openflow13::OFP_VERSION < dpt.get_version()) {
@@ -44,19 +96,117 @@ void cbasebox::handle_dpt_open(rofl::crofdpt &dpt) {
   VLOG(1) << __FUNCTION__ << "] dpid: " << dpt.get_dpid().str()
           << " dpt: " << dpt;
 
+  // port numbers may have changed with this datapath
+  pout_actions_stale = true;
+  bridging_active = -1;
+  tap_man->clear_port_nos();
+
+  capacity.set_reserve_percent(FLAGS_table_reserve_percent);
+
+  // the delete takes the ARP punt flow along, init() installs both again
+  policer.reset_meters(dpt);
+
+  // packet-ins without an output action, like source MAC learning, are
+  // only inspected. The punted frames for the taps have their own max_len.
+  dpt.send_set_config_message(
+      rofl::cauxid(0), rofl::openflow13::OFPC_FRAG_NORMAL,
+      std::min(std::max(FLAGS_pktin_miss_send_len, 0),
+               (int)rofl::openflow13::OFPCML_NO_BUFFER));
+
   dpt.send_features_request(rofl::cauxid(0));
   dpt.send_desc_stats_request(rofl::cauxid(0), 0);
+  dpt.send_table_features_stats_request(rofl::cauxid(0), 0);
+  dpt.send_table_stats_request(rofl::cauxid(0), 0);
   dpt.send_port_desc_stats_request(rofl::cauxid(0), 0);
 
   // todo timeout?
 }
 
-void cbasebox::handle_wakeup(rofl::cthread &thread) {
-  LOG(WARNING) << __FUNCTION__ << "] XXX not implemented";
+void cbasebox::handle_wakeup(rofl::cthread &thread) { flush_packet_outs(); }
+
+void cbasebox::handle_timeout(rofl::cthread &thread, uint32_t timer_id,
+                              const std::list<unsigned int> &ttypes) {
+  switch (timer_id) {
+  case TIMER_STATS: {
+    uint64_t pkts = pout_stats.pkts - pout_stats.last_pkts;
+    pout_stats.last_pkts = pout_stats.pkts;
+
+    LOG(INFO) << "packet-out: " << pout_stats.pkts << " pkts ("
+              << pkts / FLAGS_stats_interval << " pps) in "
+              << pout_stats.batches << " batches (avg "
+              << (pout_stats.batches ? pout_stats.pkts / pout_stats.batches
+                                     : 0)
+              << ", max " << pout_stats.batch_max << "), "
+              << pout_stats.drops << " dropped";
+    LOG(INFO) << "packet-in: " << pktin_stats.truncated
+              << " truncated dropped, " << pktin_stats.released
+              << " switch buffers released";
+    LOG(INFO) << "table capacity:" << std::endl << capacity;
+    LOG(INFO) << "switch programming: " << ops;
+    LOG(INFO) << "packet pool:" << std::endl
+              << rofcore::cpacketpool::get_instance();
+    LOG(INFO) << "tap devices:" << std::endl << *tap_man;
+    LOG(INFO) << "packet-in policers:" << std::endl << policer;
+    LOG(INFO) << "checkpoint: " << checkpoint;
+
+    // resync the occupancy from the switch
+    try {
+      rofl::crofdpt &dpt = set_dpt(dptid, true);
+      if (dpt.is_established()) {
+        dpt.send_table_stats_request(rofl::cauxid(0), 0);
+      }
+    } catch (rofl::eRofBaseNotFound &e) {
+      // not connected
+    }
+
+    schedule_stats();
+  } break;
+  case TIMER_OPS:
+    handle_ops_timer();
+    thread.add_timer(TIMER_OPS, rofl::ctimespec().expire_in(1));
+    break;
+  case TIMER_CHECKPOINT:
+    remove_stale_entries();
+    break;
+  case TIMER_RESTORE: {
+    bool start = false;
+    try {
+      rofl::crofdpt &dpt = set_dpt(dptid, true);
+      rofl::AcquireReadWriteLock fdb_lock(fdb_rwlock);
+      rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+      if (restore_state != RESTORE_DONE) {
+        start = restore_cold(dpt, "no switch state in time");
+      }
+    } catch (rofl::eRofBaseNotFound &e) {
+      // not connected, the next connection starts over
+    }
+    if (start) {
+      tap_man->start();
+    }
+  } break;
+  default:
+    break;
+  }
+}
+
+void cbasebox::schedule_stats() {
+  if (FLAGS_stats_interval > 0) {
+    thread.add_timer(TIMER_STATS,
+                     rofl::ctimespec().expire_in(FLAGS_stats_interval));
+  }
 }
 
 void cbasebox::handle_dpt_close(const rofl::cdptid &dptid) {
   LOG(INFO) << __FUNCTION__ << "] dptid: " << dptid.str();
+
+  // a stale congestion must not stall netlink processing
+  nbi->congestion_solved();
+
+  // resolved again once the datapath is back
+  tap_man->clear_port_nos();
+
+  rofl::AcquireReadWriteLock lock(fdb_rwlock);
+  ops.clear();
 }
 
 void cbasebox::handle_conn_terminated(rofl::crofdpt &dpt,
@@ -81,12 +231,15 @@ void cbasebox::handle_conn_negotiation_failed(rofl::crofdpt &dpt,
 
 void cbasebox::handle_conn_congestion_occured(rofl::crofdpt &dpt,
                                               const rofl::cauxid &auxid) {
-  LOG(ERROR) << __FUNCTION__ << ": XXX not implemented";
+  LOG(WARNING) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str();
+  // stop draining netlink updates into the congested channel
+  nbi->congestion_occured();
 }
 
 void cbasebox::handle_conn_congestion_solved(rofl::crofdpt &dpt,
                                              const rofl::cauxid &auxid) {
-  LOG(ERROR) << __FUNCTION__ << ": XXX not implemented";
+  LOG(INFO) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str();
+  nbi->congestion_solved();
 }
 
 void cbasebox::handle_features_reply(
@@ -129,6 +282,26 @@ void cbasebox::handle_packet_in(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
   default:
     break;
   }
+
+  release_pktin_buffer(dpt, msg);
+}
+
+void cbasebox::release_pktin_buffer(rofl::crofdpt &dpt,
+                                    rofl::openflow::cofmsg_packet_in &msg) {
+  if (msg.get_buffer_id() ==
+      rofl::openflow::base::get_ofp_no_buffer(dpt.get_version())) {
+    return;
+  }
+
+  // a packet-out without actions drops the buffered frame
+  try {
+    rofl::openflow::cofactions actions(dpt.get_version());
+    dpt.send_packet_out_message(rofl::cauxid(0), msg.get_buffer_id(),
+                                msg.get_match().get_in_port(), actions);
+    pktin_stats.released++;
+  } catch (std::exception &e) {
+    LOG(ERROR) << __FUNCTION__ << ": " << e.what();
+  }
 }
 
 void cbasebox::handle_flow_removed(rofl::crofdpt &dpt,
@@ -161,8 +334,81 @@ void cbasebox::handle_port_status(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
           << " pkt received: " << std::endl
           << msg;
 
-  // XXX FIXME not implemented
-  LOG(WARNING) << __FUNCTION__ << ": not implemented";
+  const rofl::openflow::cofport &port = msg.get_port();
+
+  // the port number is resolved again on the next packet-out
+  tap_man->clear_port_no(port.get_name());
+
+  set_port_link(dpt, port.get_port_no(),
+                msg.get_reason() != rofl::openflow13::OFPPR_DELETE &&
+                    port_is_up(port));
+}
+
+void cbasebox::set_port_link(rofl::crofdpt &dpt, uint32_t of_port, bool up) {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  using std::chrono::steady_clock;
+
+  auto port_id = of_port_to_port_id.find(of_port);
+  if (port_id == of_port_to_port_id.end()) {
+    LOG(WARNING) << __FUNCTION__ << ": unknown port " << of_port;
+    return;
+  }
+
+  steady_clock::time_point t0 = steady_clock::now();
+  try {
+    // the kernel bridge stops forwarding to the port and ages out its
+    // entries at once
+    tap_man->get_dev(port_id->second).set_carrier(up);
+  } catch (std::exception &e) {
+    LOG(ERROR) << __FUNCTION__ << " exception: " << e.what();
+  }
+
+  unsigned flushed = 0;
+  if (not up) {
+    // a single flow-mod instead of one per entry netlink reports removed
+    fm_templates.remove_bridging_unicast_learned(dpt, of_port);
+
+    rofl::AcquireReadWriteLock lock(fdb_rwlock);
+    auto it = fdb.lower_bound(fdb_key(port_id->second, 0, (uint64_t)0));
+    while (it != fdb.end() && it->first.port == (uint32_t)port_id->second) {
+      if (not it->second.learned) {
+        ++it;
+        continue;
+      }
+      capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+      checkpoint.erase_fdb(it->first.port, it->first.vid, it->first.mac);
+      it = fdb.erase(it);
+      flushed++;
+    }
+  }
+
+  unsigned vlans = 0;
+  bool changed;
+  {
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    changed =
+        up ? ports_down.erase(of_port) : ports_down.insert(of_port).second;
+    for (auto &vlan : l2_domain) {
+      if (not changed) {
+        break;
+      }
+      if (vlan.second.count(ofdpa_group_id_l2_interface(of_port, vlan.first))) {
+        update_l2_flood(dpt, vlan.first);
+        vlans++;
+      }
+    }
+  }
+  if (changed) {
+    policer.resize_arp_punt(dpt, ports_up());
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": port " << of_port
+            << (up ? " up" : " down") << ", " << flushed
+            << " learned entries flushed, " << vlans
+            << " flood groups updated in "
+            << duration_cast<microseconds>(steady_clock::now() - t0).count()
+            << "us";
 }
 
 void cbasebox::handle_error_message(rofl::crofdpt &dpt,
@@ -172,8 +418,219 @@ void cbasebox::handle_error_message(rofl::crofdpt &dpt,
             << " pkt received: " << std::endl
             << msg;
 
-  // XXX FIXME not implemented
-  LOG(WARNING) << __FUNCTION__ << ": not implemented";
+  handle_op_error(dpt, msg);
+
+  const rofl::cmemory &body = msg.get_body();
+
+  switch (msg.get_err_type()) {
+  case rofl::openflow13::OFPET_FLOW_MOD_FAILED:
+    if (rofl::openflow13::OFPFMFC_TABLE_FULL == msg.get_err_code() &&
+        body.memlen() > FLOW_MOD_TABLE_ID_OFFSET) {
+      enum ofdpa_capacity::table t = ofdpa_capacity::from_table_id(
+          body.somem()[FLOW_MOD_TABLE_ID_OFFSET]);
+      if (t != ofdpa_capacity::TABLE_MAX) {
+        capacity.table_full(t);
+      }
+    }
+    break;
+  case rofl::openflow13::OFPET_GROUP_MOD_FAILED:
+    if (rofl::openflow13::OFPGMFC_OUT_OF_GROUPS == msg.get_err_code()) {
+      capacity.table_full(ofdpa_capacity::TABLE_GROUP);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void cbasebox::handle_op_error(rofl::crofdpt &dpt,
+                               rofl::openflow::cofmsg_error &msg) {
+  // fdb_rwlock is held while sending tracked bridging entries and
+  // l2_domain_rwlock while sending groups, so the xid is recorded before
+  // its error can be looked up
+  rofl::AcquireReadWriteLock lock(fdb_rwlock);
+  rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+  ofdpa_op_tracker::op o;
+
+  switch (ops.failed(msg.get_xid(), msg.get_err_type(), msg.get_err_code(),
+                     o)) {
+  case ofdpa_op_tracker::RESULT_RETRY:
+    VLOG(1) << __FUNCTION__ << ": retrying "
+            << ofdpa_op_tracker::op_name(o.type) << " xid=" << msg.get_xid()
+            << " port=" << o.port << " vid=" << o.vid << " mac=" << o.mac
+            << " retries=" << o.retries;
+    break;
+  case ofdpa_op_tracker::RESULT_FAILED:
+    if (o.is_bridging()) {
+      LOG(ERROR) << __FUNCTION__ << ": " << ofdpa_op_tracker::op_name(o.type)
+                 << " port=" << o.port << " vid=" << o.vid << " mac=" << o.mac
+                 << " failed after " << o.retries << " retries";
+    } else {
+      LOG(ERROR) << __FUNCTION__ << ": " << ofdpa_op_tracker::op_name(o.type)
+                 << " port=" << o.port << " vid=" << o.vid << " failed after "
+                 << o.retries << " retries";
+    }
+    if (o.type == ofdpa_op_tracker::OP_BRIDGING_ADD) {
+      fdb_key key(o.port, o.vid, o.mac);
+      if (fdb.erase(key)) {
+        // not offloaded, don't account it
+        capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+        checkpoint.erase_fdb(key.port, key.vid, key.mac);
+      }
+    } else if (o.type == ofdpa_op_tracker::OP_VLAN_ADD) {
+      if (vlan_entries.erase(std::make_tuple(o.port, o.vid, o.untagged))) {
+        capacity.release(ofdpa_capacity::TABLE_VLAN);
+      }
+    } else if (o.type ==
+               ofdpa_op_tracker::OP_GROUP_L2_UNFILTERED_INTERFACE_ADD) {
+      if (unfiltered_ports.erase(o.port)) {
+        capacity.release(ofdpa_capacity::TABLE_GROUP);
+      }
+    } else if (o.type == ofdpa_op_tracker::OP_GROUP_L2_INTERFACE_ADD) {
+      auto of_port = port_id_to_of_port.find(o.port);
+      auto vlan = l2_domain.find(o.vid);
+      if (of_port != port_id_to_of_port.end() && vlan != l2_domain.end() &&
+          vlan->second.erase(
+              ofdpa_group_id_l2_interface(of_port->second, o.vid))) {
+        // not offloaded, and the flood group must not refer to it
+        capacity.release(ofdpa_capacity::TABLE_GROUP,
+                         vlan->second.empty() ? 2 : 1);
+        checkpoint.erase_group(o.vid, of_port->second);
+        update_l2_flood(dpt, o.vid);
+      }
+    }
+    break;
+  case ofdpa_op_tracker::RESULT_UNKNOWN:
+  default:
+    break;
+  }
+}
+
+void cbasebox::handle_ops_timer() {
+  try {
+    rofl::crofdpt &dpt = set_dpt(dptid, true);
+    if (not dpt.is_established()) {
+      return;
+    }
+
+    rofl::AcquireReadWriteLock lock(fdb_rwlock);
+    rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+    std::map<uint16_t, unsigned> floods; // vid -> retries
+    for (auto &o : ops.due_retries()) {
+      // flood groups and entries of a vlan are built again as a whole
+      if (o.type == ofdpa_op_tracker::OP_BRIDGING_DLF_ADD ||
+          o.type == ofdpa_op_tracker::OP_BRIDGING_DLF_REMOVE ||
+          o.type == ofdpa_op_tracker::OP_GROUP_L2_FLOOD_ADD ||
+          o.type == ofdpa_op_tracker::OP_GROUP_L2_FLOOD_REMOVE) {
+        floods[o.vid] = std::max(floods[o.vid], o.retries);
+        continue;
+      }
+
+      auto of_port = port_id_to_of_port.find(o.port);
+      if (of_port == port_id_to_of_port.end()) {
+        continue; // port is gone
+      }
+
+      // skip operations superseded in the meantime
+      auto entry = fdb.find(fdb_key(o.port, o.vid, o.mac));
+      bool in_fdb = entry != fdb.end();
+      auto vlan = l2_domain.find(o.vid);
+      bool in_l2_domain =
+          vlan != l2_domain.end() &&
+          vlan->second.count(
+              ofdpa_group_id_l2_interface(of_port->second, o.vid));
+      uint32_t xid;
+      switch (o.type) {
+      case ofdpa_op_tracker::OP_BRIDGING_ADD:
+        if (not in_fdb) {
+          continue;
+        }
+        xid = fm_templates.add_bridging_unicast_vlan(
+            dpt, of_port->second, o.vid, o.mac, true, o.filtered,
+            entry->second.learned);
+        break;
+      case ofdpa_op_tracker::OP_BRIDGING_REMOVE:
+        if (in_fdb) {
+          continue;
+        }
+        xid = fm_templates.remove_bridging_unicast_vlan(dpt, of_port->second,
+                                                        o.vid, o.mac);
+        break;
+      case ofdpa_op_tracker::OP_VLAN_ADD:
+        if (not vlan_entries.count(
+                std::make_tuple(o.port, o.vid, o.untagged))) {
+          continue;
+        }
+        xid = fm_templates.add_vlan_ingress(dpt, of_port->second, o.vid,
+                                            o.untagged);
+        break;
+      case ofdpa_op_tracker::OP_VLAN_REMOVE:
+        if (vlan_entries.count(std::make_tuple(o.port, o.vid, o.untagged))) {
+          continue;
+        }
+        xid = fm_templates.remove_vlan_ingress(dpt, of_port->second, o.vid,
+                                               o.untagged);
+        break;
+      case ofdpa_op_tracker::OP_GROUP_L2_UNFILTERED_INTERFACE_ADD:
+        if (not unfiltered_ports.count(o.port)) {
+          continue;
+        }
+        xid = fm_templates.add_group_l2_unfiltered_interface(dpt,
+                                                             of_port->second);
+        break;
+      case ofdpa_op_tracker::OP_GROUP_L2_UNFILTERED_INTERFACE_REMOVE:
+        if (unfiltered_ports.count(o.port)) {
+          continue;
+        }
+        xid = fm_templates.remove_group_l2_unfiltered_interface(
+            dpt, of_port->second);
+        break;
+      case ofdpa_op_tracker::OP_GROUP_L2_INTERFACE_ADD:
+        if (not in_l2_domain) {
+          continue;
+        }
+        // replaces a group left over from an earlier run
+        xid = fm_templates.add_group_l2_interface(
+            dpt, of_port->second, o.vid, o.untagged,
+            o.err_type == rofl::openflow13::OFPET_GROUP_MOD_FAILED &&
+                o.err_code == rofl::openflow13::OFPGMFC_GROUP_EXISTS);
+        // the flood group may have failed on it
+        floods[o.vid] = std::max(floods[o.vid], o.retries);
+        break;
+      case ofdpa_op_tracker::OP_GROUP_L2_INTERFACE_REMOVE:
+        if (in_l2_domain) {
+          continue;
+        }
+        xid = fm_templates.remove_group_l2_interface(dpt, of_port->second,
+                                                     o.vid);
+        break;
+      default:
+        continue;
+      }
+      ops.sent(xid, o);
+    }
+
+    for (auto &f : floods) {
+      update_l2_flood(dpt, f.first, f.second);
+    }
+
+    // confirms everything sent so far that did not fail
+    if (ops.needs_barrier()) {
+      ops.barrier_sent(dpt.send_barrier_request(rofl::cauxid(0)));
+    }
+  } catch (rofl::eRofBaseNotFound &e) {
+    // not connected
+  }
+}
+
+void cbasebox::handle_barrier_reply(
+    rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+    rofl::openflow::cofmsg_barrier_reply &msg) {
+  VLOG(2) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str()
+          << " xid=" << msg.get_xid();
+
+  rofl::AcquireReadWriteLock lock(fdb_rwlock);
+  ops.barrier_reply(msg.get_xid());
 }
 
 void cbasebox::handle_port_desc_stats_reply(
@@ -192,6 +649,107 @@ void cbasebox::handle_port_desc_stats_reply_timeout(rofl::crofdpt &dpt,
   LOG(WARNING) << ": not implemented";
 }
 
+void cbasebox::handle_table_features_stats_reply(
+    rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+    rofl::openflow::cofmsg_table_features_stats_reply &msg) {
+  VLOG(1) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str()
+          << " pkt received: " << std::endl
+          << msg;
+
+  static const uint8_t table_ids[] = {OFDPA_FLOW_TABLE_ID_VLAN,
+                                      OFDPA_FLOW_TABLE_ID_BRIDGING,
+                                      OFDPA_FLOW_TABLE_ID_ACL_POLICY};
+
+  for (auto table_id : table_ids) {
+    if (not msg.get_tables().has_table(table_id)) {
+      continue;
+    }
+    capacity.set_max_entries(
+        ofdpa_capacity::from_table_id(table_id),
+        msg.get_tables().get_table(table_id).get_max_entries());
+  }
+}
+
+void cbasebox::handle_table_stats_reply(
+    rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+    rofl::openflow::cofmsg_table_stats_reply &msg) {
+  VLOG(1) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str()
+          << " pkt received: " << std::endl
+          << msg;
+
+  static const uint8_t table_ids[] = {OFDPA_FLOW_TABLE_ID_VLAN,
+                                      OFDPA_FLOW_TABLE_ID_BRIDGING,
+                                      OFDPA_FLOW_TABLE_ID_ACL_POLICY};
+
+  for (auto table_id : table_ids) {
+    if (not msg.get_table_stats_array().has_table_stats(table_id)) {
+      continue;
+    }
+    uint32_t active = msg.get_table_stats_array()
+                          .get_table_stats(table_id)
+                          .get_active_count();
+    capacity.set_active_entries(ofdpa_capacity::from_table_id(table_id),
+                                active);
+    if (table_id == OFDPA_FLOW_TABLE_ID_BRIDGING) {
+      bridging_active = active;
+    }
+  }
+
+  bool start = false;
+  {
+    rofl::AcquireReadWriteLock fdb_lock(fdb_rwlock);
+    rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+    if (restore_state == RESTORE_TABLE_STATS) {
+      start = restore_check_occupancy(dpt);
+    }
+  }
+  if (start) {
+    tap_man->start();
+  }
+}
+
+void cbasebox::handle_flow_stats_reply(
+    rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+    rofl::openflow::cofmsg_flow_stats_reply &msg) {
+  VLOG(1) << __FUNCTION__ << ": dpid=" << dpt.get_dpid().str()
+          << " pkt received: " << std::endl
+          << msg;
+
+  bool start = false;
+  {
+    rofl::AcquireReadWriteLock fdb_lock(fdb_rwlock);
+    rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+    if (restore_state != RESTORE_FLOW_STATS) {
+      return;
+    }
+
+    const rofl::openflow::cofflowstatsarray &stats =
+        msg.get_flow_stats_array();
+    for (auto i : stats.keys()) {
+      uint32_t of_port;
+      uint16_t vid;
+      rofl::cmacaddr mac;
+      if (not ofdpa_fm_templates::get_bridging_unicast(
+              stats.get_flow_stats(i), of_port, vid, mac)) {
+        continue;
+      }
+      restore_reported++;
+      auto port = of_port_to_port_id.find(of_port);
+      if (port != of_port_to_port_id.end()) {
+        restore_entries.insert(fdb_key(port->second, vid, mac));
+      }
+    }
+
+    // a multipart reply, the last part completes it
+    if (not(msg.get_stats_flags() & rofl::openflow13::OFPMPF_REPLY_MORE)) {
+      start = restore_check_entries(dpt);
+    }
+  }
+  if (start) {
+    tap_man->start();
+  }
+}
+
 void cbasebox::handle_experimenter_message(
     rofl::crofdpt &dpt, const rofl::cauxid &auxid,
     rofl::openflow::cofmsg_experimenter &msg) {
@@ -263,16 +821,52 @@ void cbasebox::handle_acl_policy_table(rofl::crofdpt &dpt,
                                        rofl::openflow::cofmsg_packet_in &msg) {
   using rofl::openflow::cofport;
 
+  // cut at miss_send_len, the host needs the whole frame
+  if (msg.get_packet().length() < msg.get_total_len()) {
+    VLOG(1) << __FUNCTION__ << ": dropping packet-in truncated to "
+            << msg.get_packet().length() << " of " << msg.get_total_len()
+            << " bytes";
+    pktin_stats.truncated++;
+    return;
+  }
+
   try {
     const cofport &port =
         dpt.get_ports().get_port(msg.get_match().get_in_port());
 
-    rofl::cpacket *pkt = rofcore::cpacketpool::get_instance().acquire_pkt();
-    *pkt = msg.get_packet();
+    // police before a buffer is taken
+    enum pktin_policer::traffic_class c = pktin_policer::classify(
+        msg.get_packet().soframe(), msg.get_packet().length());
+    if (not policer.admit(port.get_port_no(), c)) {
+      VLOG(2) << __FUNCTION__ << ": policed packet-in on port "
+              << port.get_port_no();
+      return;
+    }
 
-    tap_man->get_dev(of_port_to_port_id.at(port.get_port_no())).enqueue(pkt);
-  } catch (rofcore::ePacketPoolExhausted &e) {
-    LOG(ERROR) << __FUNCTION__ << " ePacketPoolExhausted: " << e.what();
+    rofcore::ctapdev &dev =
+        tap_man->get_dev(of_port_to_port_id.at(port.get_port_no()));
+
+    // written from the message buffer if the tap has nothing queued
+    if (dev.send(msg.get_packet().soframe(), msg.get_packet().length())) {
+      return;
+    }
+
+    rofcore::packet *pkt = rofcore::cpacketpool::get_instance().acquire_pkt(
+        msg.get_packet().length());
+    if (pkt == NULL) {
+      LOG(ERROR) << __FUNCTION__ << ": no packet buffer for packet-in of "
+                 << msg.get_packet().length() << " bytes";
+      return;
+    }
+    if (not pkt->assign(msg.get_packet().soframe(),
+                        msg.get_packet().length())) {
+      LOG(ERROR) << __FUNCTION__ << ": dropping oversized packet-in of "
+                 << msg.get_packet().length() << " bytes";
+      rofcore::cpacketpool::get_instance().release_pkt(pkt);
+      return;
+    }
+
+    dev.enqueue(pkt);
   } catch (std::exception &e) {
     LOG(ERROR) << __FUNCTION__ << " exception: " << e.what();
   }
@@ -320,7 +914,12 @@ void cbasebox::handle_bridging_table_rm(
 void cbasebox::init(rofl::crofdpt &dpt) {
   using rofl::openflow::cofport;
 
+  using std::chrono::duration_cast;
+  using std::chrono::milliseconds;
+  using std::chrono::steady_clock;
+
   std::deque<std::string> ports;
+  steady_clock::time_point t0 = steady_clock::now();
 
   /* init 1:1 port mapping */
   try {
@@ -336,76 +935,376 @@ void cbasebox::init(rofl::crofdpt &dpt) {
       const rofl::openflow::cofport &port = dpt.get_ports().get_port(i.second);
       of_port_to_port_id[port.get_port_no()] = i.first;
       port_id_to_of_port[i.first] = port.get_port_no();
+      tap_man->get_dev(i.first).set_port_no(port.get_port_no());
+
+      // no carrier on the taps of ports without link from the start
+      bool up = port_is_up(port);
+      tap_man->get_dev(i.first).set_carrier(up);
+      rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+      if (up) {
+        ports_down.erase(port.get_port_no());
+      } else {
+        ports_down.insert(port.get_port_no());
+      }
     }
 
-    tap_man->start();
+    // netlink subscribes only once, the meter was reset on this connect
+    if (arp_punt) {
+      install_arp_punt(dpt);
+    }
+    steady_clock::time_point t1 = steady_clock::now();
+
+    LOG(INFO) << devs.size() << " ports initialized in "
+              << duration_cast<milliseconds>(t1 - t0).count() << "ms";
 
-    LOG(INFO) << "ports initialized";
+    // the taps, and with them netlink, start once the checkpoint is
+    // compared with the switch
+    restore_checkpoint(dpt);
 
   } catch (std::exception &e) {
     LOG(ERROR) << __FUNCTION__ << "] ERROR: unknown error " << e.what();
   }
 }
 
-int cbasebox::enqueue(rofcore::ctapdev *tapdev, rofl::cpacket *pkt) {
+void cbasebox::restore_checkpoint(rofl::crofdpt &dpt) {
+  bool start = true;
+  if (checkpoint.is_open()) {
+    uint64_t dpid = dpt.get_dpid().get_uint64_t();
+    rofl::AcquireReadWriteLock fdb_lock(fdb_rwlock);
+    rofl::AcquireReadWriteLock l2_lock(l2_domain_rwlock);
+
+    if (not fdb.empty() || not l2_domain.empty()) {
+      // a reconnect, the state in memory is current
+      if (not checkpoint.matches(dpid, port_id_to_of_port)) {
+        checkpoint.reset(dpid, port_id_to_of_port);
+      }
+    } else if (not checkpoint.matches(dpid, port_id_to_of_port)) {
+      start = restore_cold(dpt, "checkpoint of another switch or port "
+                                "mapping, or interrupted");
+    } else {
+      restore_state = RESTORE_TABLE_STATS;
+      restore_entries.clear();
+      restore_reported = 0;
+      thread.add_timer(TIMER_RESTORE,
+                       rofl::ctimespec().expire_in(
+                           std::max(FLAGS_checkpoint_restore_timeout, 0)));
+      // the table stats reply may have been received already
+      start = restore_check_occupancy(dpt);
+    }
+  }
+
+  if (start) {
+    tap_man->start();
+  }
+}
+
+bool cbasebox::restore_check_occupancy(rofl::crofdpt &dpt) {
+  if (bridging_active < 0) {
+    return false; // the table stats reply is due
+  }
+
+  std::vector<ofdpa_checkpoint::fdb_record> fdbs;
+  std::vector<ofdpa_checkpoint::group_record> groups;
+  checkpoint.get_fdb(fdbs);
+  checkpoint.get_groups(groups);
+
+  // the bridging table holds the fdb entries and a flooding flow per vlan,
+  // update_l2_flood() removed it in vlans without a member port up
+  std::set<uint16_t> flooded;
+  for (auto &g : groups) {
+    if (not ports_down.count(g.of_port)) {
+      flooded.insert(g.vid);
+    }
+  }
+  int64_t expected = fdbs.size() + flooded.size();
+
+  if (bridging_active != expected) {
+    std::stringstream reason;
+    reason << "checkpoint has " << expected << " bridging entries, switch "
+           << bridging_active;
+    return restore_cold(dpt, reason.str());
+  }
+
+  restore_state = RESTORE_FLOW_STATS;
+  fm_templates.send_bridging_unicast_stats_request(dpt);
+  return false;
+}
+
+bool cbasebox::restore_check_entries(rofl::crofdpt &dpt) {
+  std::vector<ofdpa_checkpoint::fdb_record> fdbs;
+  std::vector<ofdpa_checkpoint::group_record> groups;
+  checkpoint.get_fdb(fdbs);
+  checkpoint.get_groups(groups);
+
+  if (restore_reported != fdbs.size()) {
+    std::stringstream reason;
+    reason << "checkpoint has " << fdbs.size() << " unicast entries, switch "
+           << restore_reported;
+    return restore_cold(dpt, reason.str());
+  }
+  for (auto &r : fdbs) {
+    if (not restore_entries.count(fdb_key(r.port, r.vid, r.mac))) {
+      return restore_cold(dpt, "unicast entries differ from the switch");
+    }
+  }
+
+  for (auto &r : fdbs) {
+    fdb_entry &e = fdb[fdb_key(r.port, r.vid, r.mac)];
+    e.learned = r.flags & ofdpa_checkpoint::FDB_LEARNED;
+    e.filtered = r.flags & ofdpa_checkpoint::FDB_FILTERED;
+    e.stale = true;
+    e.age = ++fdb_age;
+  }
+
+  // the bridging table occupancy was taken from the switch already
+  std::set<uint16_t> vids, flooded;
+  for (auto &g : groups) {
+    l2_domain[g.vid].insert(ofdpa_group_id_l2_interface(g.of_port, g.vid));
+    stale_groups[std::make_pair(g.vid, g.of_port)] = g.untagged;
+    vids.insert(g.vid);
+    if (not ports_down.count(g.of_port)) {
+      flooded.insert(g.vid);
+    }
+  }
+  capacity.admit(ofdpa_capacity::TABLE_GROUP, false,
+                 groups.size() + flooded.size());
+
+  restore_state = RESTORE_DONE;
+  restore_entries.clear();
+
+  LOG(INFO) << __FUNCTION__ << ": warm start, restored " << fdbs.size()
+            << " fdb entries and " << groups.size() << " interface groups in "
+            << vids.size() << " vlans";
+  thread.add_timer(TIMER_CHECKPOINT, rofl::ctimespec().expire_in(std::max(
+                                         FLAGS_checkpoint_settle_time, 0)));
+  return true;
+}
+
+bool cbasebox::restore_cold(rofl::crofdpt &dpt, const std::string &reason) {
+  LOG(INFO) << __FUNCTION__ << ": cold start, " << reason;
+  checkpoint.reset(dpt.get_dpid().get_uint64_t(), port_id_to_of_port);
+  restore_state = RESTORE_DONE;
+  restore_entries.clear();
+  return true;
+}
+
+void cbasebox::remove_stale_entries() {
+  std::map<std::pair<uint16_t, uint32_t>, bool> groups;
+  size_t n = 0, n_groups = 0;
+
+  try {
+    rofl::crofdpt &dpt = set_dpt(dptid, true);
+    if (not dpt.is_established()) {
+      thread.add_timer(TIMER_CHECKPOINT, rofl::ctimespec().expire_in(1));
+      return;
+    }
+
+    {
+      rofl::AcquireReadWriteLock lock(fdb_rwlock);
+      for (auto it = fdb.begin(); it != fdb.end();) {
+        if (not it->second.stale) {
+          ++it;
+          continue;
+        }
+
+        auto of_port = port_id_to_of_port.find(it->first.port);
+        if (of_port != port_id_to_of_port.end()) {
+          rofl::cmacaddr mac = it->first.get_mac();
+          uint32_t xid = fm_templates.remove_bridging_unicast_vlan(
+              dpt, of_port->second, it->first.vid, mac);
+          ops.sent(xid,
+                   ofdpa_op_tracker::op(ofdpa_op_tracker::OP_BRIDGING_REMOVE,
+                                        it->first.port, it->first.vid, mac));
+        }
+        capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+        checkpoint.erase_fdb(it->first.port, it->first.vid, it->first.mac);
+        it = fdb.erase(it);
+        n++;
+      }
+    }
+
+    {
+      rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+      groups = stale_groups;
+    }
+  } catch (rofl::eRofBaseNotFound &e) {
+    LOG(ERROR) << __FUNCTION__ << ": " << e.what();
+    return;
+  }
+
+  // rebuilds the flooding group of the vlan each
+  for (auto &g : groups) {
+    {
+      // confirmed meanwhile
+      rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+      if (stale_groups.count(g.first) == 0) {
+        continue;
+      }
+    }
+
+    auto port = of_port_to_port_id.find(g.first.second);
+    if (port != of_port_to_port_id.end()) {
+      egress_port_vlan_remove(port->second, g.first.first, g.second);
+      n_groups++;
+    } else {
+      rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+      stale_groups.erase(g.first);
+    }
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": removed " << n << " fdb entries and "
+            << n_groups << " interface groups not found after the "
+            << "warm start";
+}
+
+int cbasebox::enqueue(rofcore::ctapdev *tapdev,
+                      std::vector<rofcore::packet *> &pkts) {
   using rofl::openflow::cofport;
-  using std::map;
   int rv = 0;
 
   assert(tapdev && "no tapdev");
-  assert(pkt && "invalid enque");
-  struct ethhdr *eth = (struct ethhdr *)pkt->soframe();
 
-  if (eth->h_dest[0] == 0x33 && eth->h_dest[1] == 0x33) {
-    VLOG(1) << __FUNCTION__ << ": drop multicast packet";
-    rv = -ENOTSUP;
+  // cleared on datapath and port changes, the connection is checked when
+  // the batch is sent
+  uint32_t portno = tapdev->get_port_no();
+  if (portno == 0) {
+    portno = resolve_port_no(tapdev, rv);
+  }
+  if (rv == -ENOTCONN) {
     goto errout;
   }
 
+  /* only send packet-out if we can determine a port-no */
+  if (portno) {
+    bool was_empty;
+    {
+      rofl::AcquireReadWriteLock rwlock(pout_batch_rwlock);
+      was_empty = pout_batch.empty();
+      for (auto pkt : pkts) {
+        assert(pkt && "invalid enque");
+        VLOG(1) << __FUNCTION__ << ": queue pkt-out, pkt:" << std::endl
+                << *pkt;
+        pout_batch.push_back(std::make_pair(portno, pkt));
+      }
+    }
+
+    // the packets queued until the thread runs are sent as one batch
+    if (was_empty) {
+      thread.wakeup();
+    }
+    pkts.clear();
+    return rv;
+  }
+
+errout:
+
+  pout_stats.drops += pkts.size();
+  for (auto pkt : pkts) {
+    rofcore::cpacketpool::get_instance().release_pkt(pkt);
+  }
+  pkts.clear();
+  return rv;
+}
+
+uint32_t cbasebox::resolve_port_no(rofcore::ctapdev *tapdev, int &rv) {
+  uint32_t portno = 0;
+
   try {
     rofl::crofdpt &dpt = set_dpt(this->dptid, true);
     if (not dpt.is_established()) {
-      LOG(WARNING) << __FUNCTION__ << "] not connected, dropping packet";
+      LOG(WARNING) << __FUNCTION__ << "] not connected, dropping packets";
       rv = -ENOTCONN;
-      goto errout;
+      return 0;
+    }
+
+    portno = dpt.get_ports().get_port(tapdev->get_devname()).get_port_no();
+    tapdev->set_port_no(portno);
+  } catch (rofl::eRofDptNotFound &e) {
+    LOG(ERROR) << __FUNCTION__
+               << "] no data path attached, dropping outgoing packets";
+  } catch (rofl::eRofBaseNotFound &e) {
+    LOG(ERROR) << __FUNCTION__ << ": " << e.what();
+  } catch (rofl::openflow::ePortsNotFound &e) {
+    LOG(ERROR) << __FUNCTION__ << ": invalid port for packet out";
+    rv = -EINVAL;
+  }
+  return portno;
+}
+
+const rofl::openflow::cofactions &
+cbasebox::get_pout_actions(rofl::crofdpt &dpt, uint32_t portno) {
+  auto it = pout_actions.find(portno);
+  if (it == pout_actions.end()) {
+    rofl::openflow::cofactions actions(dpt.get_version());
+    actions.set_action_output(rofl::cindex(0)).set_port_no(portno);
+    it = pout_actions.insert(std::make_pair(portno, actions)).first;
+  }
+  return it->second;
+}
+
+void cbasebox::flush_packet_outs() {
+  std::deque<std::pair<uint32_t, rofcore::packet *>> batch;
+  bool more = false;
+
+  {
+    rofl::AcquireReadWriteLock rwlock(pout_batch_rwlock);
+    if (pout_batch.size() <= (size_t)FLAGS_pktout_batch_size) {
+      batch.swap(pout_batch);
+    } else {
+      auto last = pout_batch.begin() + FLAGS_pktout_batch_size;
+      std::move(pout_batch.begin(), last, std::back_inserter(batch));
+      pout_batch.erase(pout_batch.begin(), last);
+      more = true;
     }
+  }
 
-    // TODO move to separate function:
-    uint32_t portno =
-        dpt.get_ports().get_port(tapdev->get_devname()).get_port_no();
+  if (batch.empty()) {
+    return;
+  }
 
-    /* only send packet-out if we can determine a port-no */
-    if (portno) {
-      VLOG(1) << __FUNCTION__ << ": send pkt-out, pkt:" << std::endl << *pkt;
+  if (pout_actions_stale.exchange(false)) {
+    pout_actions.clear();
+  }
 
-      rofl::openflow::cofactions actions(dpt.get_version());
-      //			//actions.set_action_push_vlan(rofl::cindex(0)).set_eth_type(rofl::fvlanframe::VLAN_CTAG_ETHER);
-      //			//actions.set_action_set_field(rofl::cindex(1)).set_oxm(rofl::openflow::coxmatch_ofb_vlan_vid(tapdev->get_pvid()));
-      actions.set_action_output(rofl::cindex(0)).set_port_no(portno);
+  size_t sent = 0;
+  try {
+    rofl::crofdpt &dpt = set_dpt(this->dptid, true);
 
-      dpt.send_packet_out_message(
-          rofl::cauxid(0),
-          rofl::openflow::base::get_ofp_no_buffer(dpt.get_version()),
-          rofl::openflow::base::get_ofpp_controller_port(dpt.get_version()),
-          actions, pkt->soframe(), pkt->length());
+    if (dpt.is_established()) {
+      for (auto &i : batch) {
+        dpt.send_packet_out_message(
+            rofl::cauxid(0),
+            rofl::openflow::base::get_ofp_no_buffer(dpt.get_version()),
+            rofl::openflow::base::get_ofpp_controller_port(dpt.get_version()),
+            get_pout_actions(dpt, i.first), i.second->data(),
+            i.second->length());
+        sent++;
+      }
+    } else {
+      LOG(WARNING) << __FUNCTION__ << "] not connected, dropping "
+                   << batch.size() << " packets";
     }
   } catch (rofl::eRofDptNotFound &e) {
     LOG(ERROR) << __FUNCTION__
-               << "] no data path attached, dropping outgoing packet";
-
+               << "] no data path attached, dropping outgoing packets";
   } catch (rofl::eRofBaseNotFound &e) {
     LOG(ERROR) << __FUNCTION__ << ": " << e.what();
+  }
 
-  } catch (rofl::openflow::ePortsNotFound &e) {
-    LOG(ERROR) << __FUNCTION__ << ": invalid port for packet out";
-    rv = -EINVAL;
-    goto errout;
+  for (auto &i : batch) {
+    rofcore::cpacketpool::get_instance().release_pkt(i.second);
   }
 
-errout:
+  pout_stats.pkts += sent;
+  pout_stats.drops += batch.size() - sent;
+  pout_stats.batches++;
+  if (batch.size() > pout_stats.batch_max) {
+    pout_stats.batch_max = batch.size();
+  }
 
-  rofcore::cpacketpool::get_instance().release_pkt(pkt);
-  return rv;
+  if (more) {
+    thread.wakeup();
+  }
 }
 
 int cbasebox::l2_addr_remove_all_in_vlan(uint32_t port, uint16_t vid) noexcept {
@@ -413,7 +1312,18 @@ int cbasebox::l2_addr_remove_all_in_vlan(uint32_t port, uint16_t vid) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.remove_bridging_unicast_vlan_all(dpt, of_port, vid);
+    fm_templates.remove_bridging_unicast_vlan_all(dpt, of_port, vid);
+
+    rofl::AcquireReadWriteLock lock(fdb_rwlock);
+    for (auto it = fdb.begin(); it != fdb.end();) {
+      if (it->first.port == port && (vid == 0xffff || it->first.vid == vid)) {
+        capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+        checkpoint.erase_fdb(it->first.port, it->first.vid, it->first.mac);
+        it = fdb.erase(it);
+      } else {
+        ++it;
+      }
+    }
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -421,14 +1331,83 @@ int cbasebox::l2_addr_remove_all_in_vlan(uint32_t port, uint16_t vid) noexcept {
   return rv;
 }
 
+bool cbasebox::evict_learned_fdb_entry(rofl::crofdpt &dpt) {
+  // caller holds fdb_rwlock, the entry programmed first goes
+  auto it = fdb.end();
+  for (auto e = fdb.begin(); e != fdb.end(); ++e) {
+    if (e->second.learned &&
+        port_id_to_of_port.find(e->first.port) != port_id_to_of_port.end() &&
+        (it == fdb.end() || e->second.age < it->second.age)) {
+      it = e;
+    }
+  }
+
+  if (it == fdb.end()) {
+    return false;
+  }
+
+  uint32_t of_port = port_id_to_of_port.at(it->first.port);
+  VLOG(1) << __FUNCTION__ << ": evicting port=" << it->first.port
+          << " vid=" << it->first.vid << " mac=" << it->first.get_mac();
+  rofl::cmacaddr mac = it->first.get_mac();
+  uint32_t xid = fm_templates.remove_bridging_unicast_vlan(
+      dpt, of_port, it->first.vid, mac);
+  ops.sent(xid, ofdpa_op_tracker::op(ofdpa_op_tracker::OP_BRIDGING_REMOVE,
+                                     it->first.port, it->first.vid, mac));
+  capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+  capacity.evicted(ofdpa_capacity::TABLE_BRIDGING);
+  checkpoint.erase_fdb(it->first.port, it->first.vid, it->first.mac);
+  fdb.erase(it);
+  return true;
+}
+
 int cbasebox::l2_addr_add(uint32_t port, uint16_t vid,
-                          const rofl::cmacaddr &mac, bool filtered) noexcept {
+                          const rofl::cmacaddr &mac, bool filtered,
+                          bool learned) noexcept {
   int rv = 0;
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     // XXX have the knowlege here about filtered/unfiltered?
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.add_bridging_unicast_vlan(dpt, of_port, vid, mac, true, filtered);
+    fdb_key key(port, vid, mac);
+
+    rofl::AcquireReadWriteLock lock(fdb_rwlock);
+    auto it = fdb.find(key);
+    if (it != fdb.end() && it->second.stale &&
+        it->second.learned == learned && it->second.filtered == filtered) {
+      // programmed before the restart
+      it->second.stale = false;
+      return 0;
+    }
+    if (it == fdb.end()) {
+      bool admitted =
+          capacity.admit(ofdpa_capacity::TABLE_BRIDGING, learned);
+
+      // static entries take the place of learned ones
+      if (not admitted && not learned && evict_learned_fdb_entry(dpt)) {
+        admitted = capacity.admit(ofdpa_capacity::TABLE_BRIDGING, learned);
+      }
+
+      if (not admitted) {
+        LOG(WARNING) << __FUNCTION__ << ": bridging table full, not adding "
+                     << (learned ? "learned" : "static") << " entry port="
+                     << port << " vid=" << vid << " mac=" << mac;
+        return -ENOSPC;
+      }
+      it = fdb.insert(std::make_pair(key, fdb_entry())).first;
+    }
+    it->second.learned = learned;
+    it->second.filtered = filtered;
+    it->second.stale = false;
+    it->second.age = ++fdb_age;
+    checkpoint.put_fdb(port, vid, key.mac,
+                       (learned ? ofdpa_checkpoint::FDB_LEARNED : 0) |
+                           (filtered ? ofdpa_checkpoint::FDB_FILTERED : 0));
+
+    uint32_t xid = fm_templates.add_bridging_unicast_vlan(
+        dpt, of_port, vid, mac, true, filtered, learned);
+    ops.sent(xid, ofdpa_op_tracker::op(ofdpa_op_tracker::OP_BRIDGING_ADD, port,
+                                       vid, mac, filtered));
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -442,7 +1421,26 @@ int cbasebox::l2_addr_remove(uint32_t port, uint16_t vid,
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.remove_bridging_unicast_vlan(dpt, of_port, vid, mac);
+    bool down;
+    {
+      rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+      down = ports_down.count(of_port);
+    }
+
+    rofl::AcquireReadWriteLock lock(fdb_rwlock);
+    fdb_key key(port, vid, mac);
+    if (fdb.erase(key)) {
+      capacity.release(ofdpa_capacity::TABLE_BRIDGING);
+      checkpoint.erase_fdb(port, vid, key.mac);
+    } else if (down) {
+      // flushed with the link, the kernel reports it aged out afterwards
+      return 0;
+    }
+
+    uint32_t xid =
+        fm_templates.remove_bridging_unicast_vlan(dpt, of_port, vid, mac);
+    ops.sent(xid, ofdpa_op_tracker::op(ofdpa_op_tracker::OP_BRIDGING_REMOVE,
+                                       port, vid, mac));
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -455,7 +1453,15 @@ int cbasebox::ingress_port_vlan_accept_all(uint32_t port) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.enable_port_vid_allow_all(dpt, of_port);
+    if (not capacity.admit(ofdpa_capacity::TABLE_VLAN, false)) {
+      LOG(WARNING) << __FUNCTION__ << ": vlan table full, port=" << port;
+      return -ENOSPC;
+    }
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    vlan_entries.emplace(port, 0xffff, false);
+    ops.sent(fm_templates.add_vlan_ingress(dpt, of_port, 0xffff, false),
+             ofdpa_op_tracker::op(ofdpa_op_tracker::OP_VLAN_ADD, port,
+                                  0xffff));
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -468,7 +1474,12 @@ int cbasebox::ingress_port_vlan_drop_accept_all(uint32_t port) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.disable_port_vid_allow_all(dpt, of_port);
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    vlan_entries.erase(std::make_tuple(port, 0xffff, false));
+    ops.sent(fm_templates.remove_vlan_ingress(dpt, of_port, 0xffff, false),
+             ofdpa_op_tracker::op(ofdpa_op_tracker::OP_VLAN_REMOVE, port,
+                                  0xffff));
+    capacity.release(ofdpa_capacity::TABLE_VLAN);
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -482,10 +1493,21 @@ int cbasebox::ingress_port_vlan_add(uint32_t port, uint16_t vid,
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    if (pvid) {
-      fm_driver.enable_port_pvid_ingress(dpt, of_port, vid);
-    } else {
-      fm_driver.enable_port_vid_ingress(dpt, of_port, vid);
+    // the pvid takes a second entry for untagged frames
+    if (not capacity.admit(ofdpa_capacity::TABLE_VLAN, false, pvid ? 2 : 1)) {
+      LOG(WARNING) << __FUNCTION__ << ": vlan table full, port=" << port
+                   << " vid=" << vid;
+      return -ENOSPC;
+    }
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    for (bool untagged : {false, true}) {
+      if (untagged && not pvid) {
+        break;
+      }
+      vlan_entries.emplace(port, vid, untagged);
+      ops.sent(fm_templates.add_vlan_ingress(dpt, of_port, vid, untagged),
+               ofdpa_op_tracker::op(ofdpa_op_tracker::OP_VLAN_ADD, port, vid,
+                                    untagged));
     }
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
@@ -500,11 +1522,17 @@ int cbasebox::ingress_port_vlan_remove(uint32_t port, uint16_t vid,
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    if (pvid) {
-      fm_driver.disable_port_pvid_ingress(dpt, of_port, vid);
-    } else {
-      fm_driver.disable_port_vid_ingress(dpt, of_port, vid);
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    for (bool untagged : {false, true}) {
+      if (untagged && not pvid) {
+        break;
+      }
+      vlan_entries.erase(std::make_tuple(port, vid, untagged));
+      ops.sent(fm_templates.remove_vlan_ingress(dpt, of_port, vid, untagged),
+               ofdpa_op_tracker::op(ofdpa_op_tracker::OP_VLAN_REMOVE, port,
+                                    vid, untagged));
     }
+    capacity.release(ofdpa_capacity::TABLE_VLAN, pvid ? 2 : 1);
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -517,7 +1545,16 @@ int cbasebox::egress_port_vlan_accept_all(uint32_t port) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.enable_group_l2_unfiltered_interface(dpt, of_port);
+    if (not capacity.admit(ofdpa_capacity::TABLE_GROUP, false)) {
+      LOG(WARNING) << __FUNCTION__ << ": group table full, port=" << port;
+      return -ENOSPC;
+    }
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    unfiltered_ports.insert(port);
+    ops.sent(fm_templates.add_group_l2_unfiltered_interface(dpt, of_port),
+             ofdpa_op_tracker::op(
+                 ofdpa_op_tracker::OP_GROUP_L2_UNFILTERED_INTERFACE_ADD, port,
+                 0));
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -530,7 +1567,13 @@ int cbasebox::egress_port_vlan_drop_accept_all(uint32_t port) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    fm_driver.disable_group_l2_unfiltered_interface(dpt, of_port);
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    unfiltered_ports.erase(port);
+    ops.sent(fm_templates.remove_group_l2_unfiltered_interface(dpt, of_port),
+             ofdpa_op_tracker::op(
+                 ofdpa_op_tracker::OP_GROUP_L2_UNFILTERED_INTERFACE_REMOVE,
+                 port, 0));
+    capacity.release(ofdpa_capacity::TABLE_GROUP);
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -538,6 +1581,50 @@ int cbasebox::egress_port_vlan_drop_accept_all(uint32_t port) noexcept {
   return rv;
 }
 
+unsigned cbasebox::ports_up() {
+  rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+  unsigned n = 0;
+  for (auto &p : of_port_to_port_id) {
+    n += ports_down.count(p.first) ? 0 : 1;
+  }
+  return n;
+}
+
+void cbasebox::update_l2_flood(rofl::crofdpt &dpt, uint16_t vid,
+                               unsigned retries) {
+  std::set<uint32_t> members = l2_domain[vid];
+  for (uint32_t of_port : ports_down) {
+    members.erase(ofdpa_group_id_l2_interface(of_port, vid));
+  }
+
+  // a rebuild on a retry keeps counting the retries
+  auto sent = [this, vid, retries](uint32_t xid,
+                                   enum ofdpa_op_tracker::op_type type) {
+    ofdpa_op_tracker::op o(type, 0, vid);
+    o.retries = retries;
+    ops.sent(xid, o);
+  };
+
+  // remove old L2 flooding group
+  sent(fm_templates.remove_bridging_dlf_vlan(dpt, vid),
+       ofdpa_op_tracker::OP_BRIDGING_DLF_REMOVE);
+  ops.barrier_sent(dpt.send_barrier_request(rofl::cauxid(0)));
+  sent(fm_templates.remove_group_l2_flood(dpt, vid),
+       ofdpa_op_tracker::OP_GROUP_L2_FLOOD_REMOVE);
+  ops.barrier_sent(dpt.send_barrier_request(rofl::cauxid(0)));
+
+  if (members.size()) {
+    // add new L2 flooding group
+    sent(fm_templates.add_group_l2_flood(dpt, vid, members),
+         ofdpa_op_tracker::OP_GROUP_L2_FLOOD_ADD);
+    ops.barrier_sent(dpt.send_barrier_request(rofl::cauxid(0)));
+    sent(fm_templates.add_bridging_dlf_vlan(
+             dpt, vid, ofdpa_group_id_l2_flood(vid, vid)),
+         ofdpa_op_tracker::OP_BRIDGING_DLF_ADD);
+    ops.barrier_sent(dpt.send_barrier_request(rofl::cauxid(0)));
+  }
+}
+
 int cbasebox::egress_port_vlan_add(uint32_t port, uint16_t vid,
                                    bool untagged) noexcept {
   int rv = 0;
@@ -546,21 +1633,37 @@ int cbasebox::egress_port_vlan_add(uint32_t port, uint16_t vid,
 
     // create filtered egress interface
     uint32_t of_port = port_id_to_of_port.at(port);
-    uint32_t group_id =
-        fm_driver.enable_group_l2_interface(dpt, of_port, vid, untagged);
-    l2_domain[vid].insert(group_id);
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+
+    auto stale = stale_groups.find(std::make_pair(vid, of_port));
+    if (stale != stale_groups.end()) {
+      bool programmed = stale->second == untagged;
+      stale_groups.erase(stale);
+      if (programmed) {
+        // before the restart, with the flooding group
+        return 0;
+      }
+    }
 
-    // remove old L2 flooding group
-    fm_driver.remove_bridging_dlf_vlan(dpt, vid);
-    fm_driver.send_barrier(dpt);
-    fm_driver.disable_group_l2_flood(dpt, vid, vid);
-    fm_driver.send_barrier(dpt);
+    // a new interface group, and a flood group for the first port in vid
+    uint32_t groups = 0;
+    if (0 == l2_domain[vid].count(ofdpa_group_id_l2_interface(of_port, vid))) {
+      groups = l2_domain[vid].empty() ? 2 : 1;
+    }
+    if (not capacity.admit(ofdpa_capacity::TABLE_GROUP, false, groups)) {
+      LOG(WARNING) << __FUNCTION__ << ": group table full, port=" << port
+                   << " vid=" << vid;
+      return -ENOSPC;
+    }
 
-    // add new L2 flooding group
-    group_id = fm_driver.enable_group_l2_flood(dpt, vid, vid, l2_domain[vid]);
-    fm_driver.send_barrier(dpt);
-    fm_driver.add_bridging_dlf_vlan(dpt, vid, group_id);
-    fm_driver.send_barrier(dpt);
+    uint32_t xid =
+        fm_templates.add_group_l2_interface(dpt, of_port, vid, untagged);
+    ops.sent(xid, ofdpa_op_tracker::op(
+                      ofdpa_op_tracker::OP_GROUP_L2_INTERFACE_ADD, port, vid,
+                      untagged));
+    l2_domain[vid].insert(ofdpa_group_id_l2_interface(of_port, vid));
+    checkpoint.put_group(vid, of_port, untagged);
+    update_l2_flood(dpt, vid);
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -574,25 +1677,21 @@ int cbasebox::egress_port_vlan_remove(uint32_t port, uint16_t vid,
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     uint32_t of_port = port_id_to_of_port.at(port);
-    uint32_t group_id = fm_driver.group_id_l2_interface(of_port, vid);
-    l2_domain[vid].erase(group_id);
-
-    // remove old L2 flooding group
-    fm_driver.remove_bridging_dlf_vlan(dpt, vid);
-    fm_driver.send_barrier(dpt);
-    fm_driver.disable_group_l2_flood(dpt, vid, vid);
-    fm_driver.send_barrier(dpt);
-
-    if (l2_domain[vid].size()) {
-      // add new L2 flooding group
-      group_id = fm_driver.enable_group_l2_flood(dpt, vid, vid, l2_domain[vid]);
-      fm_driver.send_barrier(dpt);
-      fm_driver.add_bridging_dlf_vlan(dpt, vid, group_id);
-      fm_driver.send_barrier(dpt);
+    uint32_t group_id = ofdpa_group_id_l2_interface(of_port, vid);
+    rofl::AcquireReadWriteLock lock(l2_domain_rwlock);
+    if (l2_domain[vid].erase(group_id)) {
+      capacity.release(ofdpa_capacity::TABLE_GROUP,
+                       l2_domain[vid].empty() ? 2 : 1);
     }
+    stale_groups.erase(std::make_pair(vid, of_port));
+    checkpoint.erase_group(vid, of_port);
+    update_l2_flood(dpt, vid);
 
     // remove filtered egress interface
-    fm_driver.disable_group_l2_interface(dpt, of_port, vid);
+    uint32_t xid = fm_templates.remove_group_l2_interface(dpt, of_port, vid);
+    ops.sent(xid, ofdpa_op_tracker::op(
+                      ofdpa_op_tracker::OP_GROUP_L2_INTERFACE_REMOVE, port,
+                      vid, untagged));
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
     rv = -EINVAL;
@@ -605,7 +1704,12 @@ int cbasebox::subscribe_to(enum swi_flags flags) noexcept {
   try {
     rofl::crofdpt &dpt = set_dpt(dptid, true);
     if (flags & switch_interface::SWIF_ARP) {
-      fm_driver.enable_policy_arp(dpt, 0, -1);
+      if (not capacity.admit(ofdpa_capacity::TABLE_ACL, false)) {
+        LOG(WARNING) << __FUNCTION__ << ": acl table full";
+        return -ENOSPC;
+      }
+      install_arp_punt(dpt);
+      arp_punt = true;
     }
   } catch (rofl::eRofBaseNotFound &e) {
     // TODO log error
@@ -614,4 +1718,12 @@ int cbasebox::subscribe_to(enum swi_flags flags) noexcept {
   return rv;
 }
 
+void cbasebox::install_arp_punt(rofl::crofdpt &dpt) {
+  if (pktin_policer::get_rate(pktin_policer::CLASS_ARP)) {
+    policer.install_arp_punt(dpt, ports_up());
+  } else {
+    fm_driver.enable_policy_arp(dpt, 0, -1);
+  }
+}
+
 } // namespace basebox
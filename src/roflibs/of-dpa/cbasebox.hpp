@@ -8,10 +8,15 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <atomic>
+#include <deque>
 #include <exception>
 #include <iostream>
+#include <map>
 #include <set>
 #include <string>
+#include <tuple>
+#include <vector>
 
 #include <glog/logging.h>
 #include <rofl/common/crofbase.h>
@@ -20,6 +25,11 @@
 
 #include "roflibs/netlink/sai.hpp"
 #include "roflibs/netlink/tap_manager.hpp"
+#include "roflibs/of-dpa/ofdpa_capacity.hpp"
+#include "roflibs/of-dpa/ofdpa_checkpoint.hpp"
+#include "roflibs/of-dpa/ofdpa_fm_templates.hpp"
+#include "roflibs/of-dpa/ofdpa_op_tracker.hpp"
+#include "roflibs/of-dpa/ofdpa_policer.hpp"
 
 namespace basebox {
 
@@ -43,6 +53,19 @@ class cbasebox : public rofl::crofbase,
                        ///(OUI)
   };
 
+  enum timer {
+    TIMER_STATS, ///< periodic statistics dump
+    TIMER_OPS,   ///< barriers and retries of tracked operations
+    TIMER_CHECKPOINT, ///< end of the resync after a warm start
+    TIMER_RESTORE,    ///< no switch state for a warm start in time
+  };
+
+  enum restore_state {
+    RESTORE_DONE,        ///< no warm start pending
+    RESTORE_TABLE_STATS, ///< waiting for the bridging table occupancy
+    RESTORE_FLOW_STATS,  ///< waiting for the unicast bridging entries
+  };
+
   static bool keep_on_running;
   rofl::cthread thread;
   rofcore::nbi *nbi;
@@ -54,11 +77,16 @@ public:
   cbasebox(rofcore::nbi *nbi,
            const rofl::openflow::cofhello_elem_versionbitmap &versionbitmap =
                rofl::openflow::cofhello_elem_versionbitmap())
-      : thread(this), nbi(nbi) {
+      : thread(this), nbi(nbi), fdb_age(0), bridging_active(-1),
+        restore_state(RESTORE_DONE), restore_reported(0), arp_punt(false),
+        pout_actions_stale(false) {
     nbi->register_switch(this);
+    checkpoint.open();
     rofl::crofbase::set_versionbitmap(versionbitmap);
     thread.start();
     tap_man = new rofcore::tap_manager();
+    schedule_stats();
+    thread.add_timer(TIMER_OPS, rofl::ctimespec().expire_in(1));
   }
 
   ~cbasebox() override { delete tap_man; }
@@ -70,6 +98,9 @@ public:
 protected:
   void handle_wakeup(rofl::cthread &thread) override;
 
+  void handle_timeout(rofl::cthread &thread, uint32_t timer_id,
+                      const std::list<unsigned int> &ttypes) override;
+
   void handle_conn_established(rofl::crofdpt &dpt,
                                const rofl::cauxid &auxid) override {
     dpt.set_conn(auxid).set_trace(true);
@@ -130,6 +161,9 @@ protected:
   void handle_error_message(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
                             rofl::openflow::cofmsg_error &msg) override;
 
+  void handle_barrier_reply(rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+                            rofl::openflow::cofmsg_barrier_reply &msg) override;
+
   void handle_port_desc_stats_reply(
       rofl::crofdpt &dpt, const rofl::cauxid &auxid,
       rofl::openflow::cofmsg_port_desc_stats_reply &msg) override;
@@ -137,6 +171,18 @@ protected:
   void handle_port_desc_stats_reply_timeout(rofl::crofdpt &dpt,
                                             uint32_t xid) override;
 
+  void handle_table_features_stats_reply(
+      rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+      rofl::openflow::cofmsg_table_features_stats_reply &msg) override;
+
+  void handle_table_stats_reply(
+      rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+      rofl::openflow::cofmsg_table_stats_reply &msg) override;
+
+  void handle_flow_stats_reply(
+      rofl::crofdpt &dpt, const rofl::cauxid &auxid,
+      rofl::openflow::cofmsg_flow_stats_reply &msg) override;
+
   void handle_experimenter_message(
       rofl::crofdpt &dpt, const rofl::cauxid &auxid,
       rofl::openflow::cofmsg_experimenter &msg) override;
@@ -145,7 +191,7 @@ public:
   // switch_interface
   int l2_addr_remove_all_in_vlan(uint32_t port, uint16_t vid) noexcept override;
   int l2_addr_add(uint32_t port, uint16_t vid, const rofl::cmacaddr &mac,
-                  bool filtered) noexcept override;
+                  bool filtered, bool learned) noexcept override;
   int l2_addr_remove(uint32_t port, uint16_t vid,
                      const rofl::cmacaddr &mac) noexcept override;
 
@@ -175,13 +221,109 @@ private:
   rofl::cdptid dptid;
   rofcore::tap_manager *tap_man;
   rofl::rofl_ofdpa_fm_driver fm_driver;
+  ofdpa_fm_templates fm_templates;
   std::map<int, uint32_t> port_id_to_of_port;
   std::map<uint32_t, int> of_port_to_port_id;
 
   std::map<uint16_t, std::set<uint32_t>> l2_domain;
+  std::set<uint32_t> ports_down; // of_port, left out of the flood groups
+  // vlan table entries, port id, vid (0xffff for all) and untagged
+  std::set<std::tuple<uint32_t, uint16_t, bool>> vlan_entries;
+  std::set<uint32_t> unfiltered_ports; // port id, with an unfiltered group
+  rofl::crwlock l2_domain_rwlock;
+
+  /* fdb entries programmed to the bridging table */
+  struct fdb_key {
+    fdb_key(uint32_t port, uint16_t vid, const rofl::cmacaddr &mac);
+
+    fdb_key(uint32_t port, uint16_t vid, uint64_t mac)
+        : port(port), vid(vid), mac(mac) {}
+
+    uint32_t port;
+    uint16_t vid;
+    uint64_t mac;
+
+    rofl::cmacaddr get_mac() const;
+
+    bool operator<(const fdb_key &other) const {
+      if (port != other.port)
+        return port < other.port;
+      if (vid != other.vid)
+        return vid < other.vid;
+      return mac < other.mac;
+    }
+  };
+  struct fdb_entry {
+    bool learned;
+    bool filtered;
+    bool stale; // restored from the checkpoint, not confirmed yet
+    uint64_t age; // fdb_age when programmed, the oldest is evicted first
+  };
+  std::map<fdb_key, fdb_entry> fdb;
+  uint64_t fdb_age;
+  rofl::crwlock fdb_rwlock;
+
+  ofdpa_capacity capacity;
+
+  /* programmed state for a warm restart */
+  ofdpa_checkpoint checkpoint;
+  std::atomic<int64_t> bridging_active; // reported by the switch
+  // restored l2 interface groups not confirmed yet, vid and of_port to
+  // untagged, protected by l2_domain_rwlock
+  std::map<std::pair<uint16_t, uint32_t>, bool> stale_groups;
+  // the comparison with the switch, protected by fdb_rwlock
+  enum restore_state restore_state;
+  std::set<fdb_key> restore_entries; // unicast entries of the switch
+  size_t restore_reported;           // including those of unknown ports
+
+  /* rate limits of the packet-ins towards the taps */
+  pktin_policer policer;
+  std::atomic<bool> arp_punt; // ARP subscribed, installed again on connect
+
+  /* flow-mods and group-mods awaiting confirmation or a retry, sent under
+   * fdb_rwlock or l2_domain_rwlock */
+  ofdpa_op_tracker ops;
+
+  /* packet-out batching, filled by the tap threads and flushed on thread */
+  std::deque<std::pair<uint32_t, rofcore::packet *>> pout_batch;
+  rofl::crwlock pout_batch_rwlock;
+  std::map<uint32_t, rofl::openflow::cofactions> pout_actions;
+  std::atomic<bool> pout_actions_stale;
+
+  struct batch_stats {
+    batch_stats() : pkts(0), batches(0), batch_max(0), drops(0), last_pkts(0) {}
+
+    uint64_t pkts;
+    uint64_t batches;
+    uint64_t batch_max;
+    std::atomic<uint64_t> drops;
+    uint64_t last_pkts;
+  } pout_stats;
+
+  struct pktin_counters {
+    pktin_counters() : truncated(0), released(0) {}
+
+    std::atomic<uint64_t> truncated;
+    std::atomic<uint64_t> released; // buffers held by the switch
+  } pktin_stats;
 
   /* IO */
-  int enqueue(rofcore::ctapdev *netdev, rofl::cpacket *pkt) override;
+  int enqueue(rofcore::ctapdev *netdev,
+              std::vector<rofcore::packet *> &pkts) override;
+
+  void flush_packet_outs();
+
+  /**
+   * look up the OpenFlow port of tapdev and cache it on the device
+   *
+   * @return the port number or 0, rv is set on errors
+   */
+  uint32_t resolve_port_no(rofcore::ctapdev *tapdev, int &rv);
+
+  const rofl::openflow::cofactions &get_pout_actions(rofl::crofdpt &dpt,
+                                                     uint32_t portno);
+
+  void schedule_stats();
 
   /* OF handler */
   void handle_srcmac_table(rofl::crofdpt &dpt,
@@ -190,11 +332,73 @@ private:
   void handle_acl_policy_table(rofl::crofdpt &dpt,
                                rofl::openflow::cofmsg_packet_in &msg);
 
+  /**
+   * drop the frame the switch buffered for a packet-in, once it was
+   * handled
+   */
+  void release_pktin_buffer(rofl::crofdpt &dpt,
+                            rofl::openflow::cofmsg_packet_in &msg);
+
   void handle_bridging_table_rm(rofl::crofdpt &dpt,
                                 rofl::openflow::cofmsg_flow_removed &msg);
 
   void init(rofl::crofdpt &dpt);
 
+  /**
+   * take the fdb and vlans from the checkpoint if it matches the switch,
+   * and start the taps
+   *
+   * The bridging table occupancy and then its unicast entries are
+   * compared with the checkpoint first, the taps are started once that
+   * is decided. The restored entries are not programmed again when
+   * netlink reports them. Those still unconfirmed after
+   * --checkpoint_settle_time are removed from the switch.
+   */
+  void restore_checkpoint(rofl::crofdpt &dpt);
+
+  /**
+   * the steps of restore_checkpoint, caller holds fdb_rwlock and
+   * l2_domain_rwlock
+   *
+   * @return true once decided, the caller starts the taps then
+   */
+  bool restore_check_occupancy(rofl::crofdpt &dpt);
+  bool restore_check_entries(rofl::crofdpt &dpt);
+  bool restore_cold(rofl::crofdpt &dpt, const std::string &reason);
+
+  void remove_stale_entries();
+
+  bool evict_learned_fdb_entry(rofl::crofdpt &dpt);
+
+  /**
+   * replace the flood group of vid by one without the ports that are down,
+   * caller holds l2_domain_rwlock
+   *
+   * @param retries of the failed operation, when building it again
+   */
+  void update_l2_flood(rofl::crofdpt &dpt, uint16_t vid,
+                       unsigned retries = 0);
+
+  /**
+   * follow a link change of a switch port: the tap carrier, the flood
+   * groups, and on link down a flush of the entries learned on the port
+   */
+  void set_port_link(rofl::crofdpt &dpt, uint32_t of_port, bool up);
+
+  /**
+   * @return number of mapped ports with link, the ARP meter is sized by it
+   */
+  unsigned ports_up();
+
+  /**
+   * punt ARP to the controller, through the ARP meter if it is rate limited
+   */
+  void install_arp_punt(rofl::crofdpt &dpt);
+
+  void handle_op_error(rofl::crofdpt &dpt, rofl::openflow::cofmsg_error &msg);
+
+  void handle_ops_timer();
+
 }; // class cbasebox
 
 } // end of namespace basebox
@@ -0,0 +1,155 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+#include <glog/logging.h>
+
+#include "roflibs/of-dpa/ofdpa_capacity.hpp"
+#include "roflibs/of-dpa/ofdpa_datatypes.hpp"
+
+namespace basebox {
+
+ofdpa_capacity::ofdpa_capacity(unsigned reserve_percent)
+    : reserve_percent(std::min(reserve_percent, 100u)) {}
+
+void ofdpa_capacity::set_reserve_percent(unsigned reserve_percent) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  // a larger reserve would wrap the limit of learned entries
+  this->reserve_percent = std::min(reserve_percent, 100u);
+}
+
+enum ofdpa_capacity::table ofdpa_capacity::from_table_id(uint8_t table_id) {
+  switch (table_id) {
+  case OFDPA_FLOW_TABLE_ID_VLAN:
+    return TABLE_VLAN;
+  case OFDPA_FLOW_TABLE_ID_BRIDGING:
+    return TABLE_BRIDGING;
+  case OFDPA_FLOW_TABLE_ID_ACL_POLICY:
+    return TABLE_ACL;
+  default:
+    return TABLE_MAX;
+  }
+}
+
+const char *ofdpa_capacity::table_name(enum table t) {
+  switch (t) {
+  case TABLE_VLAN:
+    return "vlan";
+  case TABLE_BRIDGING:
+    return "bridging";
+  case TABLE_ACL:
+    return "acl";
+  case TABLE_GROUP:
+    return "group";
+  default:
+    return "unknown";
+  }
+}
+
+void ofdpa_capacity::set_max_entries(enum table t, uint32_t max_entries) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  tables[t].max_entries = max_entries;
+  LOG(INFO) << __FUNCTION__ << ": table " << table_name(t)
+            << " max_entries=" << max_entries;
+}
+
+void ofdpa_capacity::set_active_entries(enum table t, uint32_t active) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  if (tables[t].used != active) {
+    VLOG(1) << __FUNCTION__ << ": table " << table_name(t)
+            << " resync used=" << tables[t].used << " active=" << active;
+    tables[t].used = active;
+  }
+}
+
+void ofdpa_capacity::table_full(enum table t) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  counters &c = tables[t];
+
+  c.full++;
+  if (c.max_entries == 0 || c.used < c.max_entries) {
+    // the switch knows better, clamp the size to what is in use. At least
+    // one entry, a size of 0 would turn admission control off.
+    LOG(WARNING) << __FUNCTION__ << ": table " << table_name(t)
+                 << " full at " << c.used << " entries (max_entries "
+                 << c.max_entries << ")";
+    c.max_entries = std::max<uint32_t>(c.used, 1);
+  }
+}
+
+bool ofdpa_capacity::admit(enum table t, bool learned, uint32_t n) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  counters &c = tables[t];
+
+  if (c.max_entries) {
+    uint32_t limit = c.max_entries;
+    if (learned) {
+      limit -= (uint64_t)c.max_entries * reserve_percent / 100;
+    }
+
+    if (c.used + n > limit) {
+      c.rejected++;
+      VLOG(1) << __FUNCTION__ << ": table " << table_name(t) << " rejected "
+              << (learned ? "learned" : "static") << " entry, used=" << c.used
+              << " limit=" << limit;
+      return false;
+    }
+  }
+
+  c.used += n;
+  c.admitted += n;
+  return true;
+}
+
+void ofdpa_capacity::release(enum table t, uint32_t n) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  counters &c = tables[t];
+  c.used = (c.used > n) ? c.used - n : 0;
+}
+
+uint32_t ofdpa_capacity::headroom(enum table t) const {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  const counters &c = tables[t];
+
+  if (c.max_entries == 0) {
+    return UINT32_MAX;
+  }
+  return (c.used < c.max_entries) ? c.max_entries - c.used : 0;
+}
+
+void ofdpa_capacity::evicted(enum table t) {
+  assert(t < TABLE_MAX);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  tables[t].evicted++;
+}
+
+std::ostream &operator<<(std::ostream &os, const ofdpa_capacity &c) {
+  rofl::AcquireReadWriteLock lock(c.rwlock);
+  for (int t = 0; t < ofdpa_capacity::TABLE_MAX; t++) {
+    const ofdpa_capacity::counters &tc = c.tables[t];
+    os << "<table " << ofdpa_capacity::table_name((enum ofdpa_capacity::table)t)
+       << ": used " << tc.used << "/";
+    if (tc.max_entries) {
+      os << tc.max_entries << " headroom "
+         << ((tc.used < tc.max_entries) ? tc.max_entries - tc.used : 0);
+    } else {
+      os << "?";
+    }
+    os << " admitted " << tc.admitted << " rejected " << tc.rejected
+       << " evicted " << tc.evicted << " full " << tc.full << " >"
+       << std::endl;
+  }
+  return os;
+}
+
+} // namespace basebox
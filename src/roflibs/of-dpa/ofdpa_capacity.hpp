@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+#include <rofl/common/locking.hpp>
+
+namespace basebox {
+
+/**
+ * occupancy tracking and admission control for the OF-DPA tables
+ *
+ * The sizes are taken from the table features of the switch, the
+ * occupancy is counted from our own programming and resynced from the
+ * table stats. Learned entries are only admitted as long as a reserve is
+ * left for static entries.
+ */
+class ofdpa_capacity {
+public:
+  enum table {
+    TABLE_VLAN,
+    TABLE_BRIDGING,
+    TABLE_ACL,
+    TABLE_GROUP,
+    TABLE_MAX,
+  };
+
+  ofdpa_capacity(unsigned reserve_percent = 10);
+
+  /**
+   * percentage of each table kept free for static entries
+   */
+  void set_reserve_percent(unsigned reserve_percent);
+
+  /**
+   * @return table for an OF-DPA flow table id, TABLE_MAX if not tracked
+   */
+  static enum table from_table_id(uint8_t table_id);
+
+  static const char *table_name(enum table t);
+
+  void set_max_entries(enum table t, uint32_t max_entries);
+
+  /**
+   * set the occupancy as reported by the switch
+   */
+  void set_active_entries(enum table t, uint32_t active);
+
+  /**
+   * the switch rejected an entry in table t because it is full
+   */
+  void table_full(enum table t);
+
+  /**
+   * reserve n entries in table t
+   *
+   * @return false if the entries must not be programmed
+   */
+  bool admit(enum table t, bool learned, uint32_t n = 1);
+
+  void release(enum table t, uint32_t n = 1);
+
+  /**
+   * @return number of free entries, UINT32_MAX if the size is unknown
+   */
+  uint32_t headroom(enum table t) const;
+
+  void evicted(enum table t);
+
+  friend std::ostream &operator<<(std::ostream &os, const ofdpa_capacity &c);
+
+private:
+  struct counters {
+    counters()
+        : max_entries(0), used(0), admitted(0), rejected(0), evicted(0),
+          full(0) {}
+
+    uint32_t max_entries; // 0 if unknown
+    uint32_t used;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t evicted;
+    uint64_t full;
+  };
+
+  unsigned reserve_percent;
+  counters tables[TABLE_MAX];
+  mutable rofl::crwlock rwlock;
+};
+
+} // namespace basebox
@@ -0,0 +1,327 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "roflibs/of-dpa/ofdpa_checkpoint.hpp"
+
+DEFINE_string(checkpoint_file, "",
+              "File keeping the programmed switch state for a warm "
+              "restart, empty to disable");
+DEFINE_int32(checkpoint_fdb_size, 65536,
+             "Maximum number of fdb entries in the checkpoint");
+
+namespace basebox {
+
+static const char MAGIC[8] = {'B', 'B', 'C', 'K', 'P', 'T', '0', '2'};
+
+/**
+ * makes the generation odd for the lifetime of the object. The fences
+ * keep the record stores from being moved out of it, the file outlives
+ * a crash of the process but not of the host.
+ */
+class ofdpa_checkpoint::mutation {
+public:
+  explicit mutation(header *hdr) : hdr(hdr) {
+    hdr->generation++;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+
+  ~mutation() {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    hdr->generation++;
+  }
+
+private:
+  header *hdr;
+};
+
+ofdpa_checkpoint::ofdpa_checkpoint()
+    : map_len(0), hdr(nullptr), ports(nullptr), groups(nullptr),
+      fdb(nullptr) {}
+
+ofdpa_checkpoint::~ofdpa_checkpoint() {
+  if (hdr) {
+    munmap(hdr, map_len);
+  }
+}
+
+bool ofdpa_checkpoint::open() {
+  if (FLAGS_checkpoint_file.empty() || hdr) {
+    return hdr != nullptr;
+  }
+
+  // a table of at most half load
+  uint32_t slots = 2 * std::max(FLAGS_checkpoint_fdb_size, 1);
+  map_len = sizeof(header) + MAX_PORTS * sizeof(port_record) +
+            MAX_GROUPS * sizeof(group_record) + slots * sizeof(fdb_record);
+
+  int fd = ::open(FLAGS_checkpoint_file.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    LOG(ERROR) << __FUNCTION__ << ": " << FLAGS_checkpoint_file << ": "
+               << strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  bool fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != map_len;
+  if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, map_len) < 0)) {
+    LOG(ERROR) << __FUNCTION__ << ": " << FLAGS_checkpoint_file << ": "
+               << strerror(errno);
+    ::close(fd);
+    return false;
+  }
+
+  void *p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    LOG(ERROR) << __FUNCTION__ << ": mmap " << FLAGS_checkpoint_file << ": "
+               << strerror(errno);
+    return false;
+  }
+
+  uint8_t *base = static_cast<uint8_t *>(p);
+  hdr = reinterpret_cast<header *>(base);
+  ports = reinterpret_cast<port_record *>(base + sizeof(header));
+  groups = reinterpret_cast<group_record *>(ports + MAX_PORTS);
+  fdb = reinterpret_cast<fdb_record *>(groups + MAX_GROUPS);
+
+  if (memcmp(hdr->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      hdr->fdb_slots != slots) {
+    memset(base, 0, map_len);
+    hdr->fdb_slots = slots;
+    memcpy(hdr->magic, MAGIC, sizeof(MAGIC));
+  } else if (hdr->generation & 1) {
+    LOG(WARNING) << __FUNCTION__ << ": " << FLAGS_checkpoint_file
+                 << " was left in the middle of a change";
+  }
+
+  LOG(INFO) << __FUNCTION__ << ": " << FLAGS_checkpoint_file << " "
+            << hdr->n_fdb << " fdb entries";
+  return true;
+}
+
+bool ofdpa_checkpoint::matches(uint64_t dpid,
+                               const std::map<int, uint32_t> &ports) const {
+  if (not hdr || not hdr->complete || (hdr->generation & 1) ||
+      hdr->dpid != dpid || hdr->n_ports != ports.size()) {
+    return false;
+  }
+
+  unsigned i = 0;
+  for (auto &p : ports) {
+    if (this->ports[i].port_id != p.first ||
+        this->ports[i].of_port != p.second) {
+      return false;
+    }
+    i++;
+  }
+  return true;
+}
+
+void ofdpa_checkpoint::reset(uint64_t dpid,
+                             const std::map<int, uint32_t> &ports) {
+  if (not hdr) {
+    return;
+  }
+
+  // an interrupted change is over, and starts an even generation
+  hdr->generation &= ~1ULL;
+  mutation m(hdr);
+  hdr->complete = 0;
+  memset(groups, 0, MAX_GROUPS * sizeof(group_record));
+  memset(fdb, 0, hdr->fdb_slots * sizeof(fdb_record));
+  hdr->n_fdb = 0;
+  hdr->dpid = dpid;
+
+  if (ports.size() > MAX_PORTS) {
+    set_incomplete("ports");
+    return;
+  }
+
+  unsigned i = 0;
+  for (auto &p : ports) {
+    this->ports[i].port_id = p.first;
+    this->ports[i].of_port = p.second;
+    i++;
+  }
+  hdr->n_ports = ports.size();
+  hdr->complete = 1;
+}
+
+void ofdpa_checkpoint::set_incomplete(const char *what) {
+  if (hdr->complete) {
+    LOG(WARNING) << __FUNCTION__ << ": no space for more " << what
+                 << ", the next start is a cold one";
+  }
+  hdr->complete = 0;
+}
+
+size_t ofdpa_checkpoint::fdb_slot(uint32_t port, uint16_t vid,
+                                  uint64_t mac) const {
+  uint64_t h = mac ^ ((uint64_t)port << 48) ^ ((uint64_t)vid << 32);
+  h *= 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) % hdr->fdb_slots;
+}
+
+void ofdpa_checkpoint::put_fdb(uint32_t port, uint16_t vid, uint64_t mac,
+                               uint8_t flags) {
+  if (not hdr) {
+    return;
+  }
+
+  mutation m(hdr);
+
+  size_t i = fdb_slot(port, vid, mac);
+  for (size_t n = 0; n < hdr->fdb_slots; n++) {
+    fdb_record &r = fdb[i];
+    if (not(r.flags & FDB_USED)) {
+      if (hdr->n_fdb + 1 >= hdr->fdb_slots / 2) {
+        set_incomplete("fdb entries");
+        return;
+      }
+      r.port = port;
+      r.vid = vid;
+      r.mac = mac;
+      r.flags = flags | FDB_USED; // last, the record is complete
+      hdr->n_fdb++;
+      return;
+    }
+    if (r.port == port && r.vid == vid && r.mac == mac) {
+      r.flags = flags | FDB_USED;
+      return;
+    }
+    i = (i + 1) % hdr->fdb_slots;
+  }
+}
+
+void ofdpa_checkpoint::erase_fdb(uint32_t port, uint16_t vid, uint64_t mac) {
+  if (not hdr) {
+    return;
+  }
+
+  mutation m(hdr);
+
+  size_t slots = hdr->fdb_slots;
+  size_t i = fdb_slot(port, vid, mac);
+  for (;; i = (i + 1) % slots) {
+    const fdb_record &r = fdb[i];
+    if (not(r.flags & FDB_USED)) {
+      return;
+    }
+    if (r.port == port && r.vid == vid && r.mac == mac) {
+      break;
+    }
+  }
+
+  // move the following records of the cluster up, so no lookup ends
+  // early at the freed slot
+  for (size_t j = (i + 1) % slots;; j = (j + 1) % slots) {
+    fdb_record &r = fdb[j];
+    if (not(r.flags & FDB_USED)) {
+      break;
+    }
+    size_t k = fdb_slot(r.port, r.vid, r.mac);
+    bool movable = (i <= j) ? (k <= i || k > j) : (k <= i && k > j);
+    if (movable) {
+      fdb[i] = r;
+      i = j;
+    }
+  }
+  fdb[i].flags = 0;
+  hdr->n_fdb--;
+}
+
+void ofdpa_checkpoint::put_group(uint16_t vid, uint32_t of_port,
+                                 bool untagged) {
+  if (not hdr) {
+    return;
+  }
+
+  mutation m(hdr);
+
+  group_record *free = nullptr;
+  for (unsigned i = 0; i < MAX_GROUPS; i++) {
+    group_record &r = groups[i];
+    if (r.used && r.vid == vid && r.of_port == of_port) {
+      r.untagged = untagged;
+      return;
+    }
+    if (not r.used && not free) {
+      free = &r;
+    }
+  }
+
+  if (not free) {
+    set_incomplete("groups");
+    return;
+  }
+  free->vid = vid;
+  free->of_port = of_port;
+  free->untagged = untagged;
+  free->used = 1;
+}
+
+void ofdpa_checkpoint::erase_group(uint16_t vid, uint32_t of_port) {
+  if (not hdr) {
+    return;
+  }
+
+  mutation m(hdr);
+
+  for (unsigned i = 0; i < MAX_GROUPS; i++) {
+    group_record &r = groups[i];
+    if (r.used && r.vid == vid && r.of_port == of_port) {
+      r.used = 0;
+      return;
+    }
+  }
+}
+
+void ofdpa_checkpoint::get_fdb(std::vector<fdb_record> &records) const {
+  if (not hdr) {
+    return;
+  }
+
+  records.reserve(hdr->n_fdb);
+  for (size_t i = 0; i < hdr->fdb_slots; i++) {
+    if (fdb[i].flags & FDB_USED) {
+      records.push_back(fdb[i]);
+    }
+  }
+}
+
+void ofdpa_checkpoint::get_groups(std::vector<group_record> &records) const {
+  if (not hdr) {
+    return;
+  }
+
+  for (unsigned i = 0; i < MAX_GROUPS; i++) {
+    if (groups[i].used) {
+      records.push_back(groups[i]);
+    }
+  }
+}
+
+std::ostream &operator<<(std::ostream &os, const ofdpa_checkpoint &c) {
+  if (not c.hdr) {
+    return os << "<ofdpa_checkpoint disabled>";
+  }
+  return os << "<ofdpa_checkpoint " << FLAGS_checkpoint_file << " fdb "
+            << c.hdr->n_fdb << "/" << c.hdr->fdb_slots / 2
+            << (c.hdr->complete ? "" : " incomplete") << ">";
+}
+
+} // namespace basebox
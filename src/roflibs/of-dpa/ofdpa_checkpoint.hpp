@@ -0,0 +1,125 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace basebox {
+
+/**
+ * what baseboxd programmed to the switch, kept in a memory mapped file
+ *
+ * The file holds the port mapping, the l2 interface groups of every vlan
+ * and the fdb shadow. Records are updated in place as the switch is
+ * programmed, so the state is found on the next start after baseboxd
+ * exited or crashed. It is not synced to disk, /run is the place for it.
+ * The fdb is an open addressing hash table with linear probing.
+ *
+ * The generation in the header is odd while a record is changed, so a
+ * file left by a crash in the middle of a change is not trusted.
+ */
+class ofdpa_checkpoint {
+public:
+  enum fdb_flags {
+    FDB_USED = 1,
+    FDB_LEARNED = 2,
+    FDB_FILTERED = 4,
+  };
+
+  struct fdb_record {
+    uint32_t port;
+    uint16_t vid;
+    uint8_t flags;
+    uint8_t pad;
+    uint64_t mac;
+  };
+
+  struct group_record {
+    uint32_t of_port;
+    uint16_t vid;
+    uint8_t used;
+    uint8_t untagged;
+  };
+
+  ofdpa_checkpoint();
+
+  ~ofdpa_checkpoint();
+
+  /**
+   * map the file of --checkpoint_file, a file of another layout is reset
+   *
+   * @return false if disabled or the file could not be mapped
+   */
+  bool open();
+
+  bool is_open() const { return hdr != nullptr; }
+
+  /**
+   * @return true if the state was written for dpid and this port mapping,
+   * and is complete and consistent
+   */
+  bool matches(uint64_t dpid, const std::map<int, uint32_t> &ports) const;
+
+  /**
+   * forget the state, and start a new one for dpid and ports
+   */
+  void reset(uint64_t dpid, const std::map<int, uint32_t> &ports);
+
+  void put_fdb(uint32_t port, uint16_t vid, uint64_t mac, uint8_t flags);
+
+  void erase_fdb(uint32_t port, uint16_t vid, uint64_t mac);
+
+  void put_group(uint16_t vid, uint32_t of_port, bool untagged);
+
+  void erase_group(uint16_t vid, uint32_t of_port);
+
+  void get_fdb(std::vector<fdb_record> &records) const;
+
+  void get_groups(std::vector<group_record> &records) const;
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const ofdpa_checkpoint &c);
+
+private:
+  ofdpa_checkpoint(const ofdpa_checkpoint &) = delete;
+  ofdpa_checkpoint &operator=(const ofdpa_checkpoint &) = delete;
+
+  static const unsigned MAX_PORTS = 256;
+  static const unsigned MAX_GROUPS = 4096;
+
+  struct port_record {
+    int32_t port_id;
+    uint32_t of_port;
+  };
+
+  struct header {
+    char magic[8];
+    uint64_t dpid;
+    uint32_t fdb_slots;
+    uint32_t n_fdb;
+    uint32_t n_ports;
+    uint32_t complete; // cleared when a record did not fit
+    uint64_t generation; // odd while a record is changed
+  };
+
+  class mutation;
+
+  size_t fdb_slot(uint32_t port, uint16_t vid, uint64_t mac) const;
+
+  void set_incomplete(const char *what);
+
+  size_t map_len;
+  header *hdr;
+  port_record *ports;
+  group_record *groups;
+  fdb_record *fdb;
+};
+
+} // namespace basebox
@@ -65,6 +65,39 @@ typedef enum {
 /** Source MAC Lookup Table */
 #define OFDPA_FLOW_TABLE_ID_SA_LOOKUP 254
 
+/** Group Table Entry Types */
+typedef enum {
+  OFDPA_GROUP_ENTRY_TYPE_L2_INTERFACE = 0,      /**< L2 Interface */
+  OFDPA_GROUP_ENTRY_TYPE_L3_UNICAST = 1,        /**< L3 Unicast */
+  OFDPA_GROUP_ENTRY_TYPE_L2_MULTICAST = 2,      /**< L2 Multicast */
+  OFDPA_GROUP_ENTRY_TYPE_L2_FLOOD = 4,          /**< L2 Flood */
+  OFDPA_GROUP_ENTRY_TYPE_L3_INTERFACE = 5,      /**< L3 Interface */
+  OFDPA_GROUP_ENTRY_TYPE_L3_MULTICAST = 6,      /**< L3 Multicast */
+  OFDPA_GROUP_ENTRY_TYPE_L3_ECMP = 7,           /**< L3 ECMP */
+  OFDPA_GROUP_ENTRY_TYPE_L2_OVERLAY = 8,        /**< L2 Overlay */
+  OFDPA_GROUP_ENTRY_TYPE_MPLS_LABEL = 9,        /**< MPLS Label */
+  OFDPA_GROUP_ENTRY_TYPE_MPLS_FORWARDING = 10,  /**< MPLS Forwarding */
+  OFDPA_GROUP_ENTRY_TYPE_L2_UNFILTERED_INTERFACE =
+      11, /**< L2 Unfiltered Interface */
+} OFDPA_GROUP_ENTRY_TYPE_t;
+
+static inline uint32_t ofdpa_group_id_l2_interface(uint32_t port_no,
+                                                   uint16_t vid) {
+  return (OFDPA_GROUP_ENTRY_TYPE_L2_INTERFACE << 28) |
+         ((uint32_t)(vid & 0xfff) << 16) | (port_no & 0xffff);
+}
+
+static inline uint32_t ofdpa_group_id_l2_flood(uint16_t id, uint16_t vid) {
+  return (OFDPA_GROUP_ENTRY_TYPE_L2_FLOOD << 28) |
+         ((uint32_t)(vid & 0xfff) << 16) | id;
+}
+
+static inline uint32_t
+ofdpa_group_id_l2_unfiltered_interface(uint32_t port_no) {
+  return (OFDPA_GROUP_ENTRY_TYPE_L2_UNFILTERED_INTERFACE << 28) |
+         (port_no & 0xffff);
+}
+
 enum OFDPA_FLOW_TABLE_ID_FMT_INGRESS_PORT {
   OFDPA_FTT_INGRESS_PORT_NORMAL_ETHERNET_IPV4_DSCP,
   OFDPA_FTT_INGRESS_PORT_NORMAL_ETHERNET_IPV6_DSCP,
@@ -0,0 +1,418 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <cassert>
+
+#include <glog/logging.h>
+
+#include "roflibs/of-dpa/ofdpa_datatypes.hpp"
+#include "roflibs/of-dpa/ofdpa_fm_templates.hpp"
+
+namespace basebox {
+
+static const uint16_t VLAN_PRIORITY = 3;
+static const uint16_t BRIDGING_UNICAST_PRIORITY = 2;
+static const uint16_t BRIDGING_DLF_PRIORITY = 1;
+static const uint16_t BRIDGING_IDLE_TIMEOUT = 300;
+// the lower 32 bit of the cookie carry the port of the entry
+static const uint64_t COOKIE_PORT_MASK = 0xffffffff;
+// set for entries learned by the kernel bridge
+static const uint64_t COOKIE_LEARNED = 1ULL << 32;
+// set for all unicast entries, to find them in flow stats
+static const uint64_t COOKIE_UNICAST = 1ULL << 33;
+
+void ofdpa_fm_templates::build(uint8_t ofp_version) {
+  using rofl::openflow::cofflowmod;
+
+  if (this->ofp_version == ofp_version) {
+    return;
+  }
+
+  VLOG(1) << __FUNCTION__ << ": building templates for version "
+          << (int)ofp_version;
+
+  this->ofp_version = ofp_version;
+
+  // unicast vlan bridging: eth_dst, vlan -> l2 interface group
+  fm_add = cofflowmod(ofp_version);
+  fm_add.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  fm_add.set_command(rofl::openflow13::OFPFC_ADD);
+  fm_add.set_priority(BRIDGING_UNICAST_PRIORITY);
+  fm_add.set_hard_timeout(0);
+  fm_add.set_idle_timeout(0);
+  fm_add.set_match().set_eth_dst(rofl::cmacaddr());
+  fm_add.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+  fm_add.set_instructions()
+      .set_inst_write_actions()
+      .set_actions()
+      .set_action_group(rofl::cindex(0))
+      .set_group_id(0);
+  fm_add.set_instructions().set_inst_goto_table().set_table_id(
+      OFDPA_FLOW_TABLE_ID_ACL_POLICY);
+
+  fm_remove = cofflowmod(ofp_version);
+  fm_remove.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  fm_remove.set_command(rofl::openflow13::OFPFC_DELETE_STRICT);
+  fm_remove.set_priority(BRIDGING_UNICAST_PRIORITY);
+  fm_remove.set_out_port(rofl::openflow13::OFPP_ANY);
+  fm_remove.set_out_group(rofl::openflow13::OFPG_ANY);
+  fm_remove.set_match().set_eth_dst(rofl::cmacaddr());
+  fm_remove.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+
+  // all entries of a port are found by the port in the cookie
+  fm_remove_all = cofflowmod(ofp_version);
+  fm_remove_all.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  fm_remove_all.set_command(rofl::openflow13::OFPFC_DELETE);
+  fm_remove_all.set_out_port(rofl::openflow13::OFPP_ANY);
+  fm_remove_all.set_out_group(rofl::openflow13::OFPG_ANY);
+  fm_remove_all.set_cookie_mask(COOKIE_PORT_MASK);
+
+  fm_remove_all_vlan = fm_remove_all;
+  fm_remove_all_vlan.set_match().set_vlan_vid(
+      rofl::openflow13::OFPVID_PRESENT);
+
+  fm_remove_learned = fm_remove_all;
+  fm_remove_learned.set_cookie_mask(COOKIE_PORT_MASK | COOKIE_LEARNED);
+
+  // tagged frames: in_port, vlan -> termination mac
+  fm_vlan_add = cofflowmod(ofp_version);
+  fm_vlan_add.set_table_id(OFDPA_FLOW_TABLE_ID_VLAN);
+  fm_vlan_add.set_command(rofl::openflow13::OFPFC_ADD);
+  fm_vlan_add.set_priority(VLAN_PRIORITY);
+  fm_vlan_add.set_hard_timeout(0);
+  fm_vlan_add.set_idle_timeout(0);
+  fm_vlan_add.set_match().set_in_port(0);
+  fm_vlan_add.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+  fm_vlan_add.set_instructions().set_inst_goto_table().set_table_id(
+      OFDPA_FLOW_TABLE_ID_TERMINATION_MAC);
+
+  // untagged frames: in_port, no vlan -> push the pvid, termination mac
+  fm_vlan_untagged_add = fm_vlan_add;
+  fm_vlan_untagged_add.set_match().set_vlan_vid(
+      rofl::openflow13::OFPVID_NONE);
+  fm_vlan_untagged_add.set_instructions()
+      .set_inst_apply_actions()
+      .set_actions()
+      .set_action_set_field(rofl::cindex(0))
+      .set_oxm(rofl::openflow::coxmatch_ofb_vlan_vid(
+          rofl::openflow13::OFPVID_PRESENT));
+
+  // non-strict, the match is complete and covers entries of any priority
+  fm_vlan_remove = cofflowmod(ofp_version);
+  fm_vlan_remove.set_table_id(OFDPA_FLOW_TABLE_ID_VLAN);
+  fm_vlan_remove.set_command(rofl::openflow13::OFPFC_DELETE);
+  fm_vlan_remove.set_out_port(rofl::openflow13::OFPP_ANY);
+  fm_vlan_remove.set_out_group(rofl::openflow13::OFPG_ANY);
+  fm_vlan_remove.set_match().set_in_port(0);
+  fm_vlan_remove.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+
+  // frames of any vlan
+  fm_vlan_all_add = fm_vlan_add;
+  fm_vlan_all_add.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT,
+                                           rofl::openflow13::OFPVID_PRESENT);
+  fm_vlan_all_remove = fm_vlan_remove;
+  fm_vlan_all_remove.set_match().set_vlan_vid(
+      rofl::openflow13::OFPVID_PRESENT, rofl::openflow13::OFPVID_PRESENT);
+
+  // unknown destinations of a vlan -> l2 flood group
+  fm_dlf_add = cofflowmod(ofp_version);
+  fm_dlf_add.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  fm_dlf_add.set_command(rofl::openflow13::OFPFC_ADD);
+  fm_dlf_add.set_priority(BRIDGING_DLF_PRIORITY);
+  fm_dlf_add.set_hard_timeout(0);
+  fm_dlf_add.set_idle_timeout(0);
+  fm_dlf_add.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+  fm_dlf_add.set_instructions()
+      .set_inst_write_actions()
+      .set_actions()
+      .set_action_group(rofl::cindex(0))
+      .set_group_id(0);
+  fm_dlf_add.set_instructions().set_inst_goto_table().set_table_id(
+      OFDPA_FLOW_TABLE_ID_ACL_POLICY);
+
+  fm_dlf_remove = cofflowmod(ofp_version);
+  fm_dlf_remove.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  fm_dlf_remove.set_command(rofl::openflow13::OFPFC_DELETE_STRICT);
+  fm_dlf_remove.set_priority(BRIDGING_DLF_PRIORITY);
+  fm_dlf_remove.set_out_port(rofl::openflow13::OFPP_ANY);
+  fm_dlf_remove.set_out_group(rofl::openflow13::OFPG_ANY);
+  fm_dlf_remove.set_match().set_vlan_vid(rofl::openflow13::OFPVID_PRESENT);
+}
+
+uint32_t ofdpa_fm_templates::add_bridging_unicast_vlan(
+    rofl::crofdpt &dpt, uint32_t port_no, uint16_t vid,
+    const rofl::cmacaddr &mac, bool permanent, bool filtered, bool learned) {
+  assert(vid < 0x1000);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  uint32_t group_id = filtered
+                          ? ofdpa_group_id_l2_interface(port_no, vid)
+                          : ofdpa_group_id_l2_unfiltered_interface(port_no);
+
+  fm_add.set_cookie(port_no | COOKIE_UNICAST |
+                    (learned ? COOKIE_LEARNED : 0));
+  fm_add.set_idle_timeout(permanent ? 0 : BRIDGING_IDLE_TIMEOUT);
+  fm_add.set_flags(permanent ? 0 : rofl::openflow13::OFPFF_SEND_FLOW_REM);
+  fm_add.set_match().set_eth_dst(mac);
+  fm_add.set_match().set_vlan_vid(vid | rofl::openflow13::OFPVID_PRESENT);
+  fm_add.set_instructions()
+      .set_inst_write_actions()
+      .set_actions()
+      .set_action_group(rofl::cindex(0))
+      .set_group_id(group_id);
+
+  VLOG(2) << __FUNCTION__ << ": " << fm_add;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), fm_add);
+}
+
+uint32_t ofdpa_fm_templates::remove_bridging_unicast_vlan(
+    rofl::crofdpt &dpt, uint32_t port_no, uint16_t vid,
+    const rofl::cmacaddr &mac) {
+  assert(vid < 0x1000);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  fm_remove.set_match().set_eth_dst(mac);
+  fm_remove.set_match().set_vlan_vid(vid | rofl::openflow13::OFPVID_PRESENT);
+
+  VLOG(2) << __FUNCTION__ << ": " << fm_remove;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), fm_remove);
+}
+
+void ofdpa_fm_templates::remove_bridging_unicast_vlan_all(rofl::crofdpt &dpt,
+                                                          uint32_t port_no,
+                                                          uint16_t vid) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  rofl::openflow::cofflowmod *fm = &fm_remove_all;
+  if (vid < 0x1000) {
+    fm = &fm_remove_all_vlan;
+    fm->set_match().set_vlan_vid(vid | rofl::openflow13::OFPVID_PRESENT);
+  }
+  fm->set_cookie(port_no);
+
+  VLOG(2) << __FUNCTION__ << ": " << *fm;
+  dpt.send_flow_mod_message(rofl::cauxid(0), *fm);
+}
+
+void ofdpa_fm_templates::remove_bridging_unicast_learned(rofl::crofdpt &dpt,
+                                                         uint32_t port_no) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  fm_remove_learned.set_cookie(port_no | COOKIE_LEARNED);
+
+  VLOG(2) << __FUNCTION__ << ": " << fm_remove_learned;
+  dpt.send_flow_mod_message(rofl::cauxid(0), fm_remove_learned);
+}
+
+uint32_t
+ofdpa_fm_templates::send_bridging_unicast_stats_request(rofl::crofdpt &dpt) {
+  rofl::openflow::cofflow_stats_request req(dpt.get_version());
+  req.set_table_id(OFDPA_FLOW_TABLE_ID_BRIDGING);
+  req.set_out_port(rofl::openflow13::OFPP_ANY);
+  req.set_out_group(rofl::openflow13::OFPG_ANY);
+  req.set_cookie(COOKIE_UNICAST);
+  req.set_cookie_mask(COOKIE_UNICAST);
+
+  VLOG(2) << __FUNCTION__ << ": " << req;
+  return dpt.send_flow_stats_request(rofl::cauxid(0), 0, req);
+}
+
+bool ofdpa_fm_templates::get_bridging_unicast(
+    const rofl::openflow::cofflow_stats_reply &stats, uint32_t &port_no,
+    uint16_t &vid, rofl::cmacaddr &mac) {
+  if (stats.get_table_id() != OFDPA_FLOW_TABLE_ID_BRIDGING ||
+      not(stats.get_cookie() & COOKIE_UNICAST)) {
+    return false;
+  }
+
+  port_no = stats.get_cookie() & COOKIE_PORT_MASK;
+  vid = stats.get_match().get_vlan_vid() & 0xfff;
+  mac = stats.get_match().get_eth_dst();
+  return true;
+}
+
+uint32_t ofdpa_fm_templates::add_vlan_ingress(rofl::crofdpt &dpt,
+                                              uint32_t port_no, uint16_t vid,
+                                              bool untagged) {
+  assert(vid < 0x1000 || (vid == 0xffff && not untagged));
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  rofl::openflow::cofflowmod *fm = &fm_vlan_add;
+  if (vid == 0xffff) {
+    fm = &fm_vlan_all_add;
+  } else if (untagged) {
+    fm = &fm_vlan_untagged_add;
+    fm->set_instructions()
+        .set_inst_apply_actions()
+        .set_actions()
+        .set_action_set_field(rofl::cindex(0))
+        .set_oxm(rofl::openflow::coxmatch_ofb_vlan_vid(
+            vid | rofl::openflow13::OFPVID_PRESENT));
+  } else {
+    fm->set_match().set_vlan_vid(vid | rofl::openflow13::OFPVID_PRESENT);
+  }
+  fm->set_match().set_in_port(port_no);
+
+  VLOG(2) << __FUNCTION__ << ": " << *fm;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), *fm);
+}
+
+uint32_t ofdpa_fm_templates::remove_vlan_ingress(rofl::crofdpt &dpt,
+                                                 uint32_t port_no,
+                                                 uint16_t vid,
+                                                 bool untagged) {
+  assert(vid < 0x1000 || (vid == 0xffff && not untagged));
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  rofl::openflow::cofflowmod *fm = &fm_vlan_remove;
+  if (vid == 0xffff) {
+    fm = &fm_vlan_all_remove;
+  } else {
+    fm->set_match().set_vlan_vid(
+        untagged ? (uint16_t)rofl::openflow13::OFPVID_NONE
+                 : (uint16_t)(vid | rofl::openflow13::OFPVID_PRESENT));
+  }
+  fm->set_match().set_in_port(port_no);
+
+  VLOG(2) << __FUNCTION__ << ": " << *fm;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), *fm);
+}
+
+uint32_t ofdpa_fm_templates::add_bridging_dlf_vlan(rofl::crofdpt &dpt,
+                                                   uint16_t vid,
+                                                   uint32_t group_id) {
+  assert(vid < 0x1000);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  fm_dlf_add.set_match().set_vlan_vid(vid | rofl::openflow13::OFPVID_PRESENT);
+  fm_dlf_add.set_instructions()
+      .set_inst_write_actions()
+      .set_actions()
+      .set_action_group(rofl::cindex(0))
+      .set_group_id(group_id);
+
+  VLOG(2) << __FUNCTION__ << ": " << fm_dlf_add;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), fm_dlf_add);
+}
+
+uint32_t ofdpa_fm_templates::remove_bridging_dlf_vlan(rofl::crofdpt &dpt,
+                                                      uint16_t vid) {
+  assert(vid < 0x1000);
+  rofl::AcquireReadWriteLock lock(rwlock);
+  build(dpt.get_version());
+
+  fm_dlf_remove.set_match().set_vlan_vid(vid |
+                                         rofl::openflow13::OFPVID_PRESENT);
+
+  VLOG(2) << __FUNCTION__ << ": " << fm_dlf_remove;
+  return dpt.send_flow_mod_message(rofl::cauxid(0), fm_dlf_remove);
+}
+
+uint32_t ofdpa_fm_templates::add_group_l2_interface(rofl::crofdpt &dpt,
+                                                    uint32_t port_no,
+                                                    uint16_t vid,
+                                                    bool untagged,
+                                                    bool modify) {
+  assert(vid < 0x1000);
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(modify ? rofl::openflow13::OFPGC_MODIFY
+                        : rofl::openflow13::OFPGC_ADD);
+  gm.set_type(rofl::openflow13::OFPGT_INDIRECT);
+  gm.set_group_id(ofdpa_group_id_l2_interface(port_no, vid));
+
+  rofl::openflow::cofactions &actions =
+      gm.set_buckets().add_bucket(0).set_actions();
+  if (untagged) {
+    actions.add_action_pop_vlan(rofl::cindex(0));
+  }
+  actions.add_action_output(rofl::cindex(1)).set_port_no(port_no);
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+uint32_t ofdpa_fm_templates::remove_group_l2_interface(rofl::crofdpt &dpt,
+                                                       uint32_t port_no,
+                                                       uint16_t vid) {
+  assert(vid < 0x1000);
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(rofl::openflow13::OFPGC_DELETE);
+  gm.set_type(rofl::openflow13::OFPGT_INDIRECT);
+  gm.set_group_id(ofdpa_group_id_l2_interface(port_no, vid));
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+uint32_t
+ofdpa_fm_templates::add_group_l2_unfiltered_interface(rofl::crofdpt &dpt,
+                                                      uint32_t port_no) {
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(rofl::openflow13::OFPGC_ADD);
+  gm.set_type(rofl::openflow13::OFPGT_INDIRECT);
+  gm.set_group_id(ofdpa_group_id_l2_unfiltered_interface(port_no));
+  gm.set_buckets()
+      .add_bucket(0)
+      .set_actions()
+      .add_action_output(rofl::cindex(0))
+      .set_port_no(port_no);
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+uint32_t
+ofdpa_fm_templates::remove_group_l2_unfiltered_interface(rofl::crofdpt &dpt,
+                                                         uint32_t port_no) {
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(rofl::openflow13::OFPGC_DELETE);
+  gm.set_type(rofl::openflow13::OFPGT_INDIRECT);
+  gm.set_group_id(ofdpa_group_id_l2_unfiltered_interface(port_no));
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+uint32_t ofdpa_fm_templates::add_group_l2_flood(
+    rofl::crofdpt &dpt, uint16_t vid,
+    const std::set<uint32_t> &l2_interfaces) {
+  assert(vid < 0x1000);
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(rofl::openflow13::OFPGC_ADD);
+  gm.set_type(rofl::openflow13::OFPGT_ALL);
+  gm.set_group_id(ofdpa_group_id_l2_flood(vid, vid));
+
+  uint32_t bucket_id = 0;
+  for (uint32_t group_id : l2_interfaces) {
+    gm.set_buckets()
+        .add_bucket(bucket_id++)
+        .set_actions()
+        .add_action_group(rofl::cindex(0))
+        .set_group_id(group_id);
+  }
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+uint32_t ofdpa_fm_templates::remove_group_l2_flood(rofl::crofdpt &dpt,
+                                                   uint16_t vid) {
+  assert(vid < 0x1000);
+  rofl::openflow::cofgroupmod gm(dpt.get_version());
+  gm.set_command(rofl::openflow13::OFPGC_DELETE);
+  gm.set_type(rofl::openflow13::OFPGT_ALL);
+  gm.set_group_id(ofdpa_group_id_l2_flood(vid, vid));
+
+  VLOG(2) << __FUNCTION__ << ": " << gm;
+  return dpt.send_group_mod_message(rofl::cauxid(0), gm);
+}
+
+} // namespace basebox
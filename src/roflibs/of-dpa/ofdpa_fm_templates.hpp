@@ -0,0 +1,165 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <set>
+
+#include <rofl/common/caddress.h>
+#include <rofl/common/crofdpt.h>
+#include <rofl/common/locking.hpp>
+
+namespace basebox {
+
+/**
+ * prebuilt flow-mods for the high rate bridging entries.
+ *
+ * Each flow type is built once per OpenFlow version. Programming an entry
+ * only patches the fields that differ (mac, vlan, group, cookie) in place
+ * and sends the message, instead of building match, instructions and
+ * actions from scratch for every fdb entry.
+ *
+ * The vlan table entries, the l2 interface and flood groups of a vlan and
+ * its flood entry are sent from here as well, so their xids can be tracked.
+ */
+class ofdpa_fm_templates {
+public:
+  ofdpa_fm_templates() : ofp_version(0) {}
+
+  /**
+   * @return xid of the flow-mod
+   */
+  uint32_t add_bridging_unicast_vlan(rofl::crofdpt &dpt, uint32_t port_no,
+                                     uint16_t vid, const rofl::cmacaddr &mac,
+                                     bool permanent, bool filtered,
+                                     bool learned);
+
+  /**
+   * @return xid of the flow-mod
+   */
+  uint32_t remove_bridging_unicast_vlan(rofl::crofdpt &dpt, uint32_t port_no,
+                                        uint16_t vid,
+                                        const rofl::cmacaddr &mac);
+
+  /**
+   * remove all unicast bridging entries of port_no in vid, or in all vlans
+   * if vid is 0xffff
+   */
+  void remove_bridging_unicast_vlan_all(rofl::crofdpt &dpt, uint32_t port_no,
+                                        uint16_t vid);
+
+  /**
+   * remove the unicast bridging entries of port_no in all vlans that were
+   * added as learned
+   */
+  void remove_bridging_unicast_learned(rofl::crofdpt &dpt, uint32_t port_no);
+
+  /**
+   * request the unicast bridging entries, the switch answers with flow
+   * stats replies
+   *
+   * @return xid of the request
+   */
+  uint32_t send_bridging_unicast_stats_request(rofl::crofdpt &dpt);
+
+  /**
+   * port, vid and mac of a unicast bridging entry in a flow stats reply
+   *
+   * @return false if stats is of another entry
+   */
+  static bool
+  get_bridging_unicast(const rofl::openflow::cofflow_stats_reply &stats,
+                       uint32_t &port_no, uint16_t &vid, rofl::cmacaddr &mac);
+
+  /**
+   * admit frames of vid on port_no, or untagged frames into vid, or frames
+   * of any vlan if vid is 0xffff
+   *
+   * @return xid of the flow-mod
+   */
+  uint32_t add_vlan_ingress(rofl::crofdpt &dpt, uint32_t port_no,
+                            uint16_t vid, bool untagged);
+
+  /**
+   * @return xid of the flow-mod
+   */
+  uint32_t remove_vlan_ingress(rofl::crofdpt &dpt, uint32_t port_no,
+                               uint16_t vid, bool untagged);
+
+  /**
+   * @return xid of the group-mod
+   */
+  uint32_t add_group_l2_unfiltered_interface(rofl::crofdpt &dpt,
+                                             uint32_t port_no);
+
+  /**
+   * @return xid of the group-mod
+   */
+  uint32_t remove_group_l2_unfiltered_interface(rofl::crofdpt &dpt,
+                                                uint32_t port_no);
+
+  /**
+   * flood entry of vid for unknown destinations
+   *
+   * @return xid of the flow-mod
+   */
+  uint32_t add_bridging_dlf_vlan(rofl::crofdpt &dpt, uint16_t vid,
+                                 uint32_t group_id);
+
+  /**
+   * @return xid of the flow-mod
+   */
+  uint32_t remove_bridging_dlf_vlan(rofl::crofdpt &dpt, uint16_t vid);
+
+  /**
+   * @param modify replace an existing group
+   * @return xid of the group-mod
+   */
+  uint32_t add_group_l2_interface(rofl::crofdpt &dpt, uint32_t port_no,
+                                  uint16_t vid, bool untagged,
+                                  bool modify = false);
+
+  /**
+   * @return xid of the group-mod
+   */
+  uint32_t remove_group_l2_interface(rofl::crofdpt &dpt, uint32_t port_no,
+                                     uint16_t vid);
+
+  /**
+   * flood group of vid with a bucket per l2 interface group
+   *
+   * @return xid of the group-mod
+   */
+  uint32_t add_group_l2_flood(rofl::crofdpt &dpt, uint16_t vid,
+                              const std::set<uint32_t> &l2_interfaces);
+
+  /**
+   * @return xid of the group-mod
+   */
+  uint32_t remove_group_l2_flood(rofl::crofdpt &dpt, uint16_t vid);
+
+private:
+  ofdpa_fm_templates(const ofdpa_fm_templates &) = delete;
+  ofdpa_fm_templates &operator=(const ofdpa_fm_templates &) = delete;
+
+  void build(uint8_t ofp_version);
+
+  uint8_t ofp_version;
+  rofl::openflow::cofflowmod fm_add;
+  rofl::openflow::cofflowmod fm_remove;
+  rofl::openflow::cofflowmod fm_remove_all;
+  rofl::openflow::cofflowmod fm_remove_all_vlan;
+  rofl::openflow::cofflowmod fm_remove_learned;
+  rofl::openflow::cofflowmod fm_vlan_add;
+  rofl::openflow::cofflowmod fm_vlan_untagged_add;
+  rofl::openflow::cofflowmod fm_vlan_remove;
+  rofl::openflow::cofflowmod fm_vlan_all_add;
+  rofl::openflow::cofflowmod fm_vlan_all_remove;
+  rofl::openflow::cofflowmod fm_dlf_add;
+  rofl::openflow::cofflowmod fm_dlf_remove;
+  rofl::crwlock rwlock;
+};
+
+} // namespace basebox
@@ -0,0 +1,179 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <ctime>
+
+#include <glog/logging.h>
+#include <rofl/common/openflow/openflow13.h>
+
+#include "roflibs/of-dpa/ofdpa_op_tracker.hpp"
+
+namespace basebox {
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+ofdpa_op_tracker::ofdpa_op_tracker(unsigned max_retries)
+    : max_retries(max_retries), seq(0), barrier_seq(0) {}
+
+void ofdpa_op_tracker::sent(uint32_t xid, const op &o) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  auto it = pending.insert(std::make_pair(xid, o)).first;
+  it->second = o;
+  it->second.seq = ++seq;
+  stats.sent++;
+}
+
+bool ofdpa_op_tracker::needs_barrier() const {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  return barrier_seq != seq;
+}
+
+void ofdpa_op_tracker::barrier_sent(uint32_t xid) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  barriers[xid] = seq;
+  barrier_seq = seq;
+}
+
+void ofdpa_op_tracker::barrier_reply(uint32_t xid) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  auto b = barriers.find(xid);
+  if (b == barriers.end()) {
+    return; // not ours
+  }
+
+  // barriers sent before it are answered as well, xids may have wrapped
+  uint64_t done = b->second;
+  for (auto it = barriers.begin(); it != barriers.end();) {
+    if (it->second <= done) {
+      it = barriers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (auto it = pending.begin(); it != pending.end();) {
+    if (it->second.seq <= done) {
+      stats.completed++;
+      it = pending.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+const char *ofdpa_op_tracker::op_name(enum op_type type) {
+  switch (type) {
+  case OP_BRIDGING_ADD:
+    return "bridging add";
+  case OP_BRIDGING_REMOVE:
+    return "bridging remove";
+  case OP_VLAN_ADD:
+    return "vlan add";
+  case OP_VLAN_REMOVE:
+    return "vlan remove";
+  case OP_BRIDGING_DLF_ADD:
+    return "bridging dlf add";
+  case OP_BRIDGING_DLF_REMOVE:
+    return "bridging dlf remove";
+  case OP_GROUP_L2_INTERFACE_ADD:
+    return "l2 interface group add";
+  case OP_GROUP_L2_INTERFACE_REMOVE:
+    return "l2 interface group remove";
+  case OP_GROUP_L2_UNFILTERED_INTERFACE_ADD:
+    return "l2 unfiltered interface group add";
+  case OP_GROUP_L2_UNFILTERED_INTERFACE_REMOVE:
+    return "l2 unfiltered interface group remove";
+  case OP_GROUP_L2_FLOOD_ADD:
+    return "l2 flood group add";
+  case OP_GROUP_L2_FLOOD_REMOVE:
+    return "l2 flood group remove";
+  default:
+    return "unknown";
+  }
+}
+
+bool ofdpa_op_tracker::is_transient(uint16_t err_type, uint16_t err_code) {
+  switch (err_type) {
+  case rofl::openflow13::OFPET_FLOW_MOD_FAILED:
+    // entries may be aged out or evicted in the meantime
+    return err_code == rofl::openflow13::OFPFMFC_TABLE_FULL ||
+           err_code == rofl::openflow13::OFPFMFC_UNKNOWN;
+  case rofl::openflow13::OFPET_BAD_ACTION:
+    // the l2 interface group is not yet installed
+    return err_code == rofl::openflow13::OFPBAC_BAD_OUT_GROUP;
+  case rofl::openflow13::OFPET_GROUP_MOD_FAILED:
+    // left over from an earlier run, or a flood group refers to an l2
+    // interface group that is not yet installed
+    return err_code == rofl::openflow13::OFPGMFC_GROUP_EXISTS ||
+           err_code == rofl::openflow13::OFPGMFC_INVALID_GROUP ||
+           err_code == rofl::openflow13::OFPGMFC_UNKNOWN_GROUP;
+  default:
+    return false;
+  }
+}
+
+enum ofdpa_op_tracker::result ofdpa_op_tracker::failed(uint32_t xid,
+                                                       uint16_t err_type,
+                                                       uint16_t err_code,
+                                                       op &o) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  auto it = pending.find(xid);
+  if (it == pending.end()) {
+    stats.unmatched++;
+    return RESULT_UNKNOWN;
+  }
+
+  o = it->second;
+  o.err_type = err_type;
+  o.err_code = err_code;
+  pending.erase(it);
+
+  if (not is_transient(err_type, err_code) || o.retries >= max_retries) {
+    stats.failed++;
+    return RESULT_FAILED;
+  }
+
+  // 1, 2, 4, ... seconds
+  time_t due = now() + (1 << o.retries);
+  o.retries++;
+  retry_queue.insert(std::make_pair(due, o));
+  return RESULT_RETRY;
+}
+
+std::list<ofdpa_op_tracker::op> ofdpa_op_tracker::due_retries() {
+  std::list<op> ops;
+  rofl::AcquireReadWriteLock lock(rwlock);
+  auto end = retry_queue.upper_bound(now());
+  for (auto it = retry_queue.begin(); it != end; ++it) {
+    ops.push_back(it->second);
+  }
+  retry_queue.erase(retry_queue.begin(), end);
+  stats.retried += ops.size();
+  return ops;
+}
+
+void ofdpa_op_tracker::clear() {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  pending.clear();
+  barriers.clear();
+  retry_queue.clear();
+  barrier_seq = seq;
+}
+
+std::ostream &operator<<(std::ostream &os, const ofdpa_op_tracker &t) {
+  rofl::AcquireReadWriteLock lock(t.rwlock);
+  os << "<ofdpa_op_tracker sent=" << t.stats.sent
+     << " completed=" << t.stats.completed
+     << " pending=" << t.pending.size()
+     << " retrying=" << t.retry_queue.size()
+     << " retried=" << t.stats.retried << " failed=" << t.stats.failed
+     << " unmatched=" << t.stats.unmatched << ">";
+  return os;
+}
+
+} // namespace basebox
@@ -0,0 +1,143 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <ostream>
+
+#include <rofl/common/caddress.h>
+#include <rofl/common/locking.hpp>
+
+namespace basebox {
+
+/**
+ * correlation of switch errors with the operations that caused them
+ *
+ * Every tracked flow-mod or group-mod is recorded by its xid until a
+ * barrier sent after it is answered, at which point it is known to be
+ * applied. An error for a recorded xid either schedules the operation for a
+ * retry with exponential backoff, or marks it as failed for good.
+ */
+class ofdpa_op_tracker {
+public:
+  enum op_type {
+    OP_BRIDGING_ADD,
+    OP_BRIDGING_REMOVE,
+    OP_VLAN_ADD,
+    OP_VLAN_REMOVE,
+    OP_BRIDGING_DLF_ADD,
+    OP_BRIDGING_DLF_REMOVE,
+    OP_GROUP_L2_INTERFACE_ADD,
+    OP_GROUP_L2_INTERFACE_REMOVE,
+    OP_GROUP_L2_UNFILTERED_INTERFACE_ADD,
+    OP_GROUP_L2_UNFILTERED_INTERFACE_REMOVE,
+    OP_GROUP_L2_FLOOD_ADD,
+    OP_GROUP_L2_FLOOD_REMOVE,
+  };
+
+  struct op {
+    op()
+        : type(OP_BRIDGING_ADD), port(0), vid(0), filtered(false),
+          untagged(false), retries(0), seq(0), err_type(0), err_code(0) {}
+    op(enum op_type type, uint32_t port, uint16_t vid,
+       const rofl::cmacaddr &mac, bool filtered = false)
+        : type(type), port(port), vid(vid), mac(mac), filtered(filtered),
+          untagged(false), retries(0), seq(0), err_type(0), err_code(0) {}
+    // vlan entries, groups and flood entries of a vlan, port is 0 for the
+    // latter
+    op(enum op_type type, uint32_t port, uint16_t vid, bool untagged = false)
+        : type(type), port(port), vid(vid), filtered(false),
+          untagged(untagged), retries(0), seq(0), err_type(0), err_code(0) {}
+
+    bool is_bridging() const {
+      return type == OP_BRIDGING_ADD || type == OP_BRIDGING_REMOVE;
+    }
+
+    enum op_type type;
+    uint32_t port; // port id
+    uint16_t vid;
+    rofl::cmacaddr mac;
+    bool filtered;
+    bool untagged;
+    unsigned retries;
+    uint64_t seq;
+    uint16_t err_type; // of the last failure
+    uint16_t err_code;
+  };
+
+  static const char *op_name(enum op_type type);
+
+  enum result {
+    RESULT_UNKNOWN, ///< xid not tracked
+    RESULT_RETRY,   ///< scheduled for a retry
+    RESULT_FAILED,  ///< failed permanently
+  };
+
+  ofdpa_op_tracker(unsigned max_retries = 5);
+
+  /**
+   * record o as sent with xid
+   */
+  void sent(uint32_t xid, const op &o);
+
+  /**
+   * @return true if operations were sent since the last barrier
+   */
+  bool needs_barrier() const;
+
+  void barrier_sent(uint32_t xid);
+
+  /**
+   * all operations sent before the barrier xid have been applied
+   */
+  void barrier_reply(uint32_t xid);
+
+  /**
+   * the switch rejected the message xid
+   *
+   * @param o set to the failed operation unless RESULT_UNKNOWN is returned
+   */
+  enum result failed(uint32_t xid, uint16_t err_type, uint16_t err_code,
+                     op &o);
+
+  /**
+   * @return operations whose backoff expired, to be sent again
+   */
+  std::list<op> due_retries();
+
+  /**
+   * forget about everything, e.g. when the datapath is gone
+   */
+  void clear();
+
+  friend std::ostream &operator<<(std::ostream &os, const ofdpa_op_tracker &t);
+
+private:
+  static bool is_transient(uint16_t err_type, uint16_t err_code);
+
+  struct counters {
+    counters()
+        : sent(0), completed(0), retried(0), failed(0), unmatched(0) {}
+
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t retried;
+    uint64_t failed;
+    uint64_t unmatched;
+  };
+
+  unsigned max_retries;
+  uint64_t seq;         // sequence of the last sent operation
+  uint64_t barrier_seq; // sequence covered by the last barrier sent
+  std::map<uint32_t, op> pending;           // xid -> op
+  std::map<uint32_t, uint64_t> barriers;    // xid -> seq
+  std::multimap<time_t, op> retry_queue;    // due time -> op
+  counters stats;
+  mutable rofl::crwlock rwlock;
+};
+
+} // namespace basebox
@@ -0,0 +1,215 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "roflibs/of-dpa/ofdpa_datatypes.hpp"
+#include "roflibs/of-dpa/ofdpa_policer.hpp"
+
+DEFINE_int32(pktin_rate_arp, 0,
+             "ARP packet-ins per second and port, 0 for no limit");
+DEFINE_int32(pktin_rate_nd, 0,
+             "IPv6 neighbor discovery packet-ins per second and port, 0 for "
+             "no limit");
+DEFINE_int32(pktin_rate_lldp, 0,
+             "LLDP packet-ins per second and port, 0 for no limit");
+DEFINE_int32(pktin_rate_ip, 0,
+             "Unicast IP packet-ins per second and port, 0 for no limit");
+DEFINE_int32(pktin_rate_other, 0,
+             "Other packet-ins per second and port, 0 for no limit");
+
+namespace basebox {
+
+static const uint16_t ARP_PUNT_PRIORITY = 3;
+
+static const char *class_names[pktin_policer::CLASS_MAX] = {
+    "arp", "nd", "lldp", "ip", "other",
+};
+
+enum pktin_policer::traffic_class pktin_policer::classify(const uint8_t *frame,
+                                                          size_t len) {
+  static const uint8_t lldp_dst[ETH_ALEN] = {0x01, 0x80, 0xc2,
+                                             0x00, 0x00, 0x0e};
+  size_t off = ETH_HLEN;
+
+  if (len < ETH_HLEN) {
+    return CLASS_OTHER;
+  }
+
+  uint16_t proto = (frame[12] << 8) | frame[13];
+  if (proto == ETH_P_8021Q && len >= off + 4) {
+    proto = (frame[off + 2] << 8) | frame[off + 3];
+    off += 4;
+  }
+
+  if (proto == ETH_P_LLDP || memcmp(frame, lldp_dst, ETH_ALEN) == 0) {
+    return CLASS_LLDP;
+  }
+
+  bool unicast = not(frame[0] & 0x01);
+  switch (proto) {
+  case ETH_P_ARP:
+    return CLASS_ARP;
+  case ETH_P_IPV6:
+    // router solicitation to redirect, without extension headers
+    if (len >= off + 41 && frame[off + 6] == IPPROTO_ICMPV6 &&
+        frame[off + 40] >= 133 && frame[off + 40] <= 137) {
+      return CLASS_ND;
+    }
+    return unicast ? CLASS_IP_LOCAL : CLASS_OTHER;
+  case ETH_P_IP:
+    return unicast ? CLASS_IP_LOCAL : CLASS_OTHER;
+  default:
+    return CLASS_OTHER;
+  }
+}
+
+unsigned pktin_policer::get_rate(enum traffic_class c) {
+  int rate = 0;
+  switch (c) {
+  case CLASS_ARP:
+    rate = FLAGS_pktin_rate_arp;
+    break;
+  case CLASS_ND:
+    rate = FLAGS_pktin_rate_nd;
+    break;
+  case CLASS_LLDP:
+    rate = FLAGS_pktin_rate_lldp;
+    break;
+  case CLASS_IP_LOCAL:
+    rate = FLAGS_pktin_rate_ip;
+    break;
+  default:
+    rate = FLAGS_pktin_rate_other;
+    break;
+  }
+  return std::max(rate, 0);
+}
+
+bool pktin_policer::admit(uint32_t port, enum traffic_class c) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  bucket &b = buckets[port][c];
+  unsigned rate = get_rate(c);
+
+  if (rate == 0) {
+    b.passed++;
+    return true;
+  }
+
+  std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  if (not b.initialized) {
+    b.tokens = rate;
+    b.initialized = true;
+  } else {
+    std::chrono::duration<double> elapsed = now - b.last;
+    b.tokens = std::min<double>(rate, b.tokens + elapsed.count() * rate);
+  }
+  b.last = now;
+
+  if (b.tokens < 1) {
+    b.dropped++;
+    return false;
+  }
+  b.tokens -= 1;
+  b.passed++;
+  return true;
+}
+
+void pktin_policer::reset_meters(rofl::crofdpt &dpt) {
+  rofl::AcquireReadWriteLock lock(rwlock);
+  rofl::openflow::cofmeter_bands bands(dpt.get_version());
+  dpt.send_meter_mod_message(rofl::cauxid(0), rofl::openflow13::OFPMC_DELETE,
+                             0, METER_ID_ARP, bands);
+  arp_meter_rate = 0;
+}
+
+void pktin_policer::send_arp_meter(rofl::crofdpt &dpt, uint32_t rate) {
+  rofl::openflow::cofmeter_bands bands(dpt.get_version());
+  bands.add_meter_band_drop(0).set_rate(rate).set_burst_size(rate);
+  dpt.send_meter_mod_message(rofl::cauxid(0),
+                             arp_meter_rate ? rofl::openflow13::OFPMC_MODIFY
+                                            : rofl::openflow13::OFPMC_ADD,
+                             rofl::openflow13::OFPMF_PKTPS |
+                                 rofl::openflow13::OFPMF_BURST,
+                             METER_ID_ARP, bands);
+  arp_meter_rate = rate;
+}
+
+void pktin_policer::install_arp_punt(rofl::crofdpt &dpt, unsigned n_ports) {
+  uint32_t rate = get_rate(CLASS_ARP) * std::max(n_ports, 1u);
+
+  rofl::AcquireReadWriteLock lock(rwlock);
+  send_arp_meter(dpt, rate);
+
+  rofl::openflow::cofflowmod fm(dpt.get_version());
+  fm.set_table_id(OFDPA_FLOW_TABLE_ID_ACL_POLICY);
+  fm.set_command(rofl::openflow13::OFPFC_ADD);
+  fm.set_priority(ARP_PUNT_PRIORITY);
+  fm.set_match().set_eth_type(ETH_P_ARP);
+  fm.set_instructions()
+      .set_inst_apply_actions()
+      .set_actions()
+      .add_action_output(rofl::cindex(0))
+      .set_port_no(rofl::openflow13::OFPP_CONTROLLER)
+      .set_max_len(rofl::openflow13::OFPCML_NO_BUFFER);
+  fm.set_instructions().set_inst_meter().set_meter_id(METER_ID_ARP);
+  dpt.send_flow_mod_message(rofl::cauxid(0), fm);
+
+  LOG(INFO) << __FUNCTION__ << ": arp punted through meter " << METER_ID_ARP
+            << " at " << rate << " pps";
+}
+
+void pktin_policer::resize_arp_punt(rofl::crofdpt &dpt, unsigned n_ports) {
+  uint32_t rate = get_rate(CLASS_ARP) * std::max(n_ports, 1u);
+
+  rofl::AcquireReadWriteLock lock(rwlock);
+  if (arp_meter_rate == 0 || arp_meter_rate == rate) {
+    return;
+  }
+  send_arp_meter(dpt, rate);
+
+  LOG(INFO) << __FUNCTION__ << ": arp meter " << METER_ID_ARP << " at "
+            << rate << " pps for " << n_ports << " ports";
+}
+
+std::ostream &operator<<(std::ostream &os, const pktin_policer &policer) {
+  uint64_t passed[pktin_policer::CLASS_MAX] = {};
+  uint64_t dropped[pktin_policer::CLASS_MAX] = {};
+  rofl::AcquireReadWriteLock lock(policer.rwlock);
+
+  for (auto &port : policer.buckets) {
+    bool drops = false;
+    for (unsigned c = 0; c < pktin_policer::CLASS_MAX; c++) {
+      passed[c] += port.second[c].passed;
+      dropped[c] += port.second[c].dropped;
+      drops = drops || port.second[c].dropped;
+    }
+
+    // only ports that were policed at all
+    if (drops) {
+      os << "<port " << port.first << " dropped:";
+      for (unsigned c = 0; c < pktin_policer::CLASS_MAX; c++) {
+        os << " " << class_names[c] << " " << port.second[c].dropped;
+      }
+      os << " >" << std::endl;
+    }
+  }
+
+  os << "<total";
+  for (unsigned c = 0; c < pktin_policer::CLASS_MAX; c++) {
+    os << " " << class_names[c] << " " << passed[c] << "/" << dropped[c];
+  }
+  os << " (passed/dropped) >" << std::endl;
+  return os;
+}
+
+} // namespace basebox
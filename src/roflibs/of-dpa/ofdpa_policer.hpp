@@ -0,0 +1,92 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+
+#include <rofl/common/crofdpt.h>
+#include <rofl/common/locking.hpp>
+
+namespace basebox {
+
+/**
+ * token bucket policers for the packet-ins punted to the taps
+ *
+ * Every port has a bucket per traffic class, refilled at the rate of the
+ * class and holding up to one second worth of packets. Frames are policed
+ * before a packet buffer is taken from the pool.
+ */
+class pktin_policer {
+public:
+  enum traffic_class {
+    CLASS_ARP,
+    CLASS_ND,   ///< ICMPv6 router and neighbor discovery
+    CLASS_LLDP,
+    CLASS_IP_LOCAL, ///< unicast IP, punted for the host
+    CLASS_OTHER,
+    CLASS_MAX,
+  };
+
+  static const uint32_t METER_ID_ARP = 1;
+
+  pktin_policer() : arp_meter_rate(0) {}
+
+  static enum traffic_class classify(const uint8_t *frame, size_t len);
+
+  /**
+   * @return packets per second of the class and port, 0 for no limit
+   */
+  static unsigned get_rate(enum traffic_class c);
+
+  /**
+   * @return true if the frame conforms, false if it has to be dropped
+   */
+  bool admit(uint32_t port, enum traffic_class c);
+
+  /**
+   * remove the meters the switch kept from an earlier connection, the
+   * switch removes the flows using them as well
+   */
+  void reset_meters(rofl::crofdpt &dpt);
+
+  /**
+   * punt ARP to the controller through a meter, so the switch enforces the
+   * rate of all n_ports together
+   */
+  void install_arp_punt(rofl::crofdpt &dpt, unsigned n_ports);
+
+  /**
+   * adjust the rate of the ARP meter to n_ports, if it is installed
+   */
+  void resize_arp_punt(rofl::crofdpt &dpt, unsigned n_ports);
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const pktin_policer &policer);
+
+private:
+  struct bucket {
+    bucket() : tokens(0), passed(0), dropped(0), initialized(false) {}
+
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+    uint64_t passed;
+    uint64_t dropped;
+    bool initialized;
+  };
+
+  // caller holds rwlock
+  void send_arp_meter(rofl::crofdpt &dpt, uint32_t rate);
+
+  std::map<uint32_t, std::array<bucket, CLASS_MAX>> buckets;
+  uint32_t arp_meter_rate; // 0 if the meter is not installed
+  mutable rofl::crwlock rwlock;
+};
+
+} // namespace basebox